@@ -0,0 +1,219 @@
+/*
+ * admission.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <rfb/rfb.h>
+#include "util.h"
+#include "admission.h"
+#include "metrics.h"
+
+struct bucket {
+	double tokens;
+	double stamp;
+};
+
+struct source {
+	char host[64];
+	struct bucket bucket;
+	double last_seen;
+	int held;
+	unsigned long accepted;
+	unsigned long deferred;
+	unsigned long rejected;
+};
+
+struct held_client {
+	rfbClientPtr cl;
+	struct source *src;
+	double since;
+};
+
+static struct bucket global = { ADMISSION_BURST, 0 };
+static struct source sources[ADMISSION_SOURCES];
+static struct held_client held[ADMISSION_MAX_HELD];
+static int nheld = 0;
+static unsigned long table_full = 0;	/* refused: no free source slot */
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void refill(struct bucket *b, double rate, double burst, double now)
+{
+	b->tokens += (now - b->stamp) * rate;
+	if (b->tokens > burst)
+		b->tokens = burst;
+	b->stamp = now;
+}
+
+/* Find the counters for a source address, recycling the least recently
+ * seen slot without held connections if the address is new. */
+static struct source *get_source(const char *host, double now)
+{
+	struct source *s, *victim = NULL;
+
+	for (s = sources; s < sources + ADMISSION_SOURCES; s++) {
+		if (s->host[0] && !strcmp(s->host, host))
+			return s;
+		if (s->held)
+			continue;
+		if (victim == NULL || s->last_seen < victim->last_seen)
+			victim = s;
+	}
+	if (victim == NULL)
+		return NULL;
+
+	memset(victim, 0, sizeof(*victim));
+	strncpy(victim->host, host, sizeof(victim->host) - 1);
+	victim->bucket.tokens = ADMISSION_SOURCE_BURST;
+	victim->bucket.stamp = now;
+	return victim;
+}
+
+static void log_source(int level, const struct source *s, const char *what)
+{
+	vzvnc_logger(level, "Client %s %s (source: %lu accepted, "
+			"%lu deferred, %lu rejected)", s->host, what,
+			s->accepted, s->deferred, s->rejected);
+}
+
+static int take_tokens(struct source *s, double now)
+{
+	refill(&global, ADMISSION_RATE, ADMISSION_BURST, now);
+	refill(&s->bucket, ADMISSION_SOURCE_RATE, ADMISSION_SOURCE_BURST, now);
+	if (global.tokens < 1.0 || s->bucket.tokens < 1.0)
+		return 0;
+	global.tokens -= 1.0;
+	s->bucket.tokens -= 1.0;
+	return 1;
+}
+
+static void reject(struct source *s)
+{
+	s->rejected++;
+	METRIC_INC(METRIC_CONNECTS_REJECTED);
+	/* a port scan must not turn into a log flood */
+	if ((s->rejected & (s->rejected - 1)) == 0)
+		log_source(VZ_VNC_WARN, s, "rejected");
+}
+
+enum rfbNewClientAction admission_check(rfbClientPtr cl)
+{
+	double now = now_sec();
+	const char *host = cl->host ? cl->host : "unknown";
+	struct source *s;
+
+	s = get_source(host, now);
+	if (s == NULL) {
+		table_full++;
+		METRIC_INC(METRIC_CONNECTS_REJECTED);
+		if ((table_full & (table_full - 1)) == 0)
+			vzvnc_logger(VZ_VNC_WARN, "Client %s rejected (all %d "
+					"source slots have held connections, "
+					"%lu rejected so far)", host,
+					ADMISSION_SOURCES, table_full);
+		return RFB_CLIENT_REFUSE;
+	}
+	s->last_seen = now;
+
+	/* those who are already waiting are served first */
+	if (nheld == 0 && take_tokens(s, now)) {
+		s->accepted++;
+		METRIC_INC(METRIC_CONNECTS_ACCEPTED);
+		log_source(VZ_VNC_DEBUG, s, "accepted");
+		return RFB_CLIENT_ACCEPT;
+	}
+
+	if (nheld < ADMISSION_MAX_HELD && s->held < ADMISSION_MAX_HELD_SOURCE) {
+		held[nheld].cl = cl;
+		held[nheld].src = s;
+		held[nheld].since = now;
+		nheld++;
+		s->held++;
+		s->deferred++;
+		METRIC_INC(METRIC_CONNECTS_DEFERRED);
+		log_source(VZ_VNC_INFO, s, "deferred");
+		return RFB_CLIENT_ON_HOLD;
+	}
+
+	reject(s);
+	return RFB_CLIENT_REFUSE;
+}
+
+static void drop_held(int i)
+{
+	held[i].src->held--;
+	memmove(&held[i], &held[i + 1], (nheld - i - 1) * sizeof(held[0]));
+	nheld--;
+}
+
+/* Called from the event loop: admits held connections as tokens refill
+ * and refuses the ones which waited for too long. */
+void admission_poll(rfbScreenInfoPtr screen)
+{
+	double now;
+	int i = 0;
+	(void)screen;
+
+	if (nheld == 0)
+		return;
+
+	now = now_sec();
+	while (i < nheld) {
+		rfbClientPtr cl = held[i].cl;
+		struct source *s = held[i].src;
+
+		if (take_tokens(s, now)) {
+			s->accepted++;
+			METRIC_INC(METRIC_CONNECTS_ACCEPTED);
+			drop_held(i);
+			log_source(VZ_VNC_INFO, s, "accepted after delay");
+			rfbStartOnHoldClient(cl);
+		} else if (now - held[i].since > ADMISSION_HOLD_TIMEOUT) {
+			reject(s);
+			drop_held(i);
+			rfbRefuseOnHoldClient(cl);
+		} else {
+			i++;
+		}
+	}
+}
+
+/* held connection went away on its own */
+void admission_forget(rfbClientPtr cl)
+{
+	int i;
+
+	for (i = 0; i < nheld; i++)
+		if (held[i].cl == cl) {
+			drop_held(i);
+			return;
+		}
+}
@@ -0,0 +1,64 @@
+/*
+ * admission.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <rfb/rfb.h>
+
+/*
+ * Connection admission is a pair of token buckets: one shared by all
+ * sources and one per source address. A connection that finds both
+ * buckets non-empty is accepted; otherwise it is put on hold until a
+ * token shows up, or refused if too many connections are already held.
+ * Nothing here ever sleeps: it runs on the RFB event thread.
+ */
+
+/* global bucket: sustained connections per second and burst size */
+#define ADMISSION_RATE			2.0
+#define ADMISSION_BURST			8.0
+/* per source address bucket */
+#define ADMISSION_SOURCE_RATE		0.5
+#define ADMISSION_SOURCE_BURST		3.0
+/* how many connections may wait on hold, overall and per source */
+#define ADMISSION_MAX_HELD		8
+#define ADMISSION_MAX_HELD_SOURCE	2
+/* held connection is refused if it did not get a token in time (sec) */
+#define ADMISSION_HOLD_TIMEOUT		10
+/* number of source addresses we keep counters for */
+#define ADMISSION_SOURCES		64
+
+enum rfbNewClientAction admission_check(rfbClientPtr cl);
+void admission_poll(rfbScreenInfoPtr screen);
+void admission_forget(rfbClientPtr cl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ADMISSION_H__ */
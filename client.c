@@ -0,0 +1,411 @@
+/*
+ * client.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include <rfb/rfb.h>
+#include "util.h"
+#include "console.h"
+#include "client.h"
+#include "grid.h"
+#include "textgrid.h"
+#include "metrics.h"
+#include "probes.h"
+
+/* updates smaller than this measure latency, larger ones - throughput */
+#define SMALL_UPDATE	4096
+
+long long vcNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long smooth(long avg, long sample)
+{
+	return avg ? (avg * 7 + sample) / 8 : sample;
+}
+
+static void update_policy(rfbClientPtr cl, vncClientPtr vc)
+{
+	rfbBool fast = vc->rtt && vc->rtt < VC_FAST_RTT &&
+		(!vc->bandwidth || vc->bandwidth > VC_FAST_BANDWIDTH);
+
+	vc->slow = vc->bandwidth && vc->bandwidth < VC_SLOW_BANDWIDTH;
+
+	if (fast) {
+		/* local viewer: send as soon as anything changes */
+		vc->coalesce = VC_COALESCE_MIN;
+		vc->interval = 0;
+		return;
+	}
+
+	/* remote viewer: let damage pile up for about half a round trip and
+	 * don't push the next update before the link has drained this one */
+	vc->coalesce = vc->rtt / 2;
+	if (vc->coalesce < vc->defer)
+		vc->coalesce = vc->defer;
+	if (vc->coalesce > VC_COALESCE_MAX)
+		vc->coalesce = VC_COALESCE_MAX;
+	vc->interval = 0;
+	if (vc->bandwidth)
+		vc->interval = vc->updateBytes * 1000000LL / vc->bandwidth;
+	if (vc->interval > VC_COALESCE_MAX)
+		vc->interval = VC_COALESCE_MAX;
+}
+
+/* Apply the encoding part of the policy. We may only use encodings the
+ * client asked for, and raw, which every client has to support. */
+static void apply_encoding(rfbClientPtr cl, vncClientPtr vc)
+{
+	rfbBool raw = vc->rtt && vc->rtt < VC_FAST_RTT &&
+		vc->bandwidth > VC_RAW_BANDWIDTH;
+
+	if (cl->preferredEncoding != vc->forcedEncoding) {
+		/* first update or the client sent new SetEncodings */
+		vc->clientEncoding = cl->preferredEncoding;
+		vc->forcedEncoding = -1;
+	}
+	if (raw) {
+		vc->forcedEncoding = rfbEncodingRaw;
+		cl->preferredEncoding = rfbEncodingRaw;
+	} else if (vc->forcedEncoding != -1) {
+		vc->forcedEncoding = -1;
+		cl->preferredEncoding = vc->clientEncoding;
+	}
+
+	if (vc->slow && vc->clientZlibLevel < 0) {
+		vc->clientZlibLevel = cl->zlibCompressLevel;
+		vc->clientTightLevel = cl->tightCompressLevel;
+		cl->zlibCompressLevel = 9;
+		cl->tightCompressLevel = 9;
+	} else if (!vc->slow && vc->clientZlibLevel >= 0) {
+		cl->zlibCompressLevel = vc->clientZlibLevel;
+		cl->tightCompressLevel = vc->clientTightLevel;
+		vc->clientZlibLevel = -1;
+	}
+}
+
+static void update_request_hook(rfbClientPtr cl, rfbFramebufferUpdateRequestMsg *fur)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	long long dt;
+
+	if (vc == NULL)
+		return;
+
+	vcTextGridCheck(cl);
+	/* a full refresh must not be answered from what we think it has */
+	if (!fur->incremental) {
+		memset(vc->rowSent, 0, vc->height * sizeof(uint64_t));
+		if (vc->textGrid)
+			vc->textGrid->valid = FALSE;
+	}
+
+	if (vc->updateStart == 0)
+		return;
+	dt = vcNow() - vc->updateStart;
+	vc->updateStart = 0;
+	if (dt <= 0)
+		dt = 1;
+
+	if (vc->updateBytes < SMALL_UPDATE) {
+		vc->rtt = smooth(vc->rtt, dt);
+	} else {
+		if (dt > vc->rtt)
+			dt -= vc->rtt;
+		vc->bandwidth = smooth(vc->bandwidth,
+				vc->updateBytes * 1000000LL / dt);
+	}
+	update_policy(cl, vc);
+}
+
+vncClientPtr vcClientNew(rfbClientPtr cl)
+{
+	vncConsolePtr c = (vncConsolePtr)cl->screen->screenData;
+	vncClientPtr vc = (vncClientPtr)calloc(1, sizeof(vncClient));
+
+	if (vc == NULL) {
+		rfbLog("Unable to allocate sizeof(vncClient) = %zu mem.\n", sizeof(vncClient));
+		return NULL;
+	}
+	vc->height = c->height;
+	vc->rowSent = (uint64_t *)calloc(2 * c->height, sizeof(uint64_t));
+	if (vc->rowSent == NULL) {
+		rfbLog("Unable to allocate row hashes, height = %d\n", c->height);
+		free(vc);
+		return NULL;
+	}
+	vc->rowPending = vc->rowSent + c->height;
+	vc->defer = c->deferUpdateTime;
+	vc->coalesce = c->deferUpdateTime;
+	vc->clientEncoding = cl->preferredEncoding;
+	vc->forcedEncoding = -1;
+	vc->clientZlibLevel = -1;
+	cl->clientData = vc;
+	cl->clientFramebufferUpdateRequestHook = update_request_hook;
+	METRIC_INC(METRIC_CLIENTS);
+	return vc;
+}
+
+/* damage cache hit rate per encoding, over all clients so far */
+static struct {
+	int encoding;
+	unsigned long checked, reused;
+} cache_stats[16];
+
+const char *vcEncodingName(int encoding)
+{
+	switch (encoding) {
+	case rfbEncodingRaw:		return "raw";
+	case rfbEncodingCopyRect:	return "copyrect";
+	case rfbEncodingRRE:		return "rre";
+	case rfbEncodingCoRRE:		return "corre";
+	case rfbEncodingHextile:	return "hextile";
+	case rfbEncodingZlib:		return "zlib";
+	case rfbEncodingTight:		return "tight";
+	case rfbEncodingZlibHex:	return "zlibhex";
+	case rfbEncodingUltra:		return "ultra";
+	case rfbEncodingTRLE:		return "trle";
+	case rfbEncodingZRLE:		return "zrle";
+	case rfbEncodingZYWRLE:		return "zywrle";
+	}
+	return "other";
+}
+
+static void log_cache_stats(rfbClientPtr cl, vncClientPtr vc)
+{
+	int i, enc = vc->clientEncoding;
+
+	for (i = 0; i < 16; i++)
+		if (cache_stats[i].checked == 0 || cache_stats[i].encoding == enc)
+			break;
+	if (i == 16)
+		return;
+	cache_stats[i].encoding = enc;
+	cache_stats[i].checked += vc->rowsChecked;
+	cache_stats[i].reused += vc->rowsReused;
+	if (cache_stats[i].checked == 0)
+		return;
+	vzvnc_logger(VZ_VNC_INFO, "Client %s: damage cache reused %lu of %lu "
+			"rows, %lu%% for all %s clients", cl->host,
+			vc->rowsReused, vc->rowsChecked,
+			cache_stats[i].reused * 100 / cache_stats[i].checked,
+			vcEncodingName(enc));
+}
+
+/* does libvncserver have to translate every pixel sent to this client? */
+rfbBool vcClientNativeFormat(rfbClientPtr cl)
+{
+	rfbPixelFormat *f = &cl->format, *s = &cl->screen->serverFormat;
+
+	if (f->bitsPerPixel != s->bitsPerPixel || f->trueColour != s->trueColour)
+		return FALSE;
+	if (!f->trueColour)
+		return TRUE;
+	return f->bigEndian == s->bigEndian &&
+		f->redMax == s->redMax && f->greenMax == s->greenMax &&
+		f->blueMax == s->blueMax && f->redShift == s->redShift &&
+		f->greenShift == s->greenShift && f->blueShift == s->blueShift;
+}
+
+void vcClientGone(rfbClientPtr cl)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+
+	if (vc == NULL)
+		return;
+	vzvnc_logger(VZ_VNC_INFO, "Client %s: %lu updates (%lu shared), rtt %ld us, "
+			"%ld bytes/s, %lld us per update to encode and send (%dbpp, %s)",
+			cl->host, vc->updates, vc->sharedUpdates, vc->rtt, vc->bandwidth,
+			vc->updates ? vc->encodeTime / vc->updates : 0,
+			cl->format.bitsPerPixel,
+			vcClientNativeFormat(cl) ? "native" : "translated");
+	vzvnc_logger(VZ_VNC_INFO, "Client %s: lag %ld us (max %ld us), "
+			"held back by a full socket %lu times",
+			cl->host, vc->lag, vc->maxLag, vc->held);
+	log_cache_stats(cl, vc);
+	METRIC_INC(METRIC_CLIENTS_GONE);
+	cl->clientData = NULL;
+	vcGridFree(vc->textGrid);
+	free(vc->rowSent);
+	free(vc);
+}
+
+/* displayHook: an update is about to be encoded */
+void vcClientUpdateStart(rfbClientPtr cl)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+
+	if (vc == NULL)
+		return;
+	vc->bytesBefore = rfbStatGetSentBytes(cl);
+	vc->encodeStart = vcNow();
+	PROBE1(update_start, cl->sock);
+}
+
+/* displayFinishedHook: the update is on the wire */
+void vcClientUpdateDone(rfbClientPtr cl)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	long long now = vcNow();
+
+	if (vc == NULL)
+		return;
+	/* only now is it an update the next request answers */
+	vc->updateStart = vc->encodeStart;
+	vc->updateBytes = rfbStatGetSentBytes(cl) - vc->bytesBefore;
+	vc->encodeTime += now - vc->updateStart;
+	if (vc->pendingSince)
+		metrics_time(STAGE_QUEUE, vc->updateStart - vc->pendingSince);
+	metrics_time(STAGE_SEND, now - vc->updateStart);
+	PROBE3(update_sent, cl->sock, vc->updateBytes, now - vc->updateStart);
+	if (vc->pendingSince) {
+		vc->lag = smooth(vc->lag, now - vc->pendingSince);
+		if (now - vc->pendingSince > vc->maxLag)
+			vc->maxLag = now - vc->pendingSince;
+	}
+	memcpy(vc->rowSent, vc->rowPending, vc->height * sizeof(uint64_t));
+	vc->lastUpdate = vc->updateStart;
+	vc->pendingSince = 0;
+	vc->updates++;
+	METRIC_INC(METRIC_UPDATES);
+	metrics_encoding(cl->preferredEncoding, vc->updateBytes);
+}
+
+/*
+ * Drop damage from the text rows which look exactly as the client last
+ * received them: a row cleared and redrawn with the same text by top or mc
+ * then costs a hash instead of an encoded rectangle. What the client will
+ * have after this update is kept in rowPending until it has been sent;
+ * 0 there means "unknown" and never matches.
+ */
+void vcClientFilterDamage(rfbClientPtr cl)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	vncConsolePtr c = (vncConsolePtr)cl->screen->screenData;
+	sraRegionPtr row, tmp;
+	rfbBool damaged;
+	uint64_t h;
+	int y;
+
+	if (vc == NULL)
+		return;
+	/* encoding is decided before the fan-out path looks at it */
+	apply_encoding(cl, vc);
+
+	for (y = 0; y < vc->height; y++) {
+		vc->rowPending[y] = vc->rowSent[y];
+		row = sraRgnCreateRect(0, y * c->cHeight,
+				cl->screen->width, (y + 1) * c->cHeight);
+		tmp = sraRgnCreateRgn(cl->copyRegion);
+		if (sraRgnAnd(tmp, row)) {
+			/* the client is going to move pixels here */
+			vc->rowPending[y] = 0;
+			goto next;
+		}
+
+		sraRgnMakeEmpty(tmp);
+		sraRgnOr(tmp, cl->modifiedRegion);
+		damaged = sraRgnAnd(tmp, row);
+		if (!damaged)
+			goto next;
+
+		h = vcRowHash(c, y);
+		vc->rowsChecked++;
+		if (h && h == vc->rowSent[y]) {
+			sraRgnSubtract(cl->modifiedRegion, row);
+			vc->rowsReused++;
+			goto next;
+		}
+
+		/* only a row sent as a whole is known after the update */
+		sraRgnMakeEmpty(tmp);
+		sraRgnOr(tmp, row);
+		vc->rowPending[y] = sraRgnSubtract(tmp, cl->requestedRegion) ? 0 : h;
+next:
+		sraRgnDestroy(tmp);
+		sraRgnDestroy(row);
+	}
+}
+
+/* bytes the client has not taken from its socket yet */
+static int socket_backlog(rfbClientPtr cl)
+{
+	int outq;
+
+	if (cl->sock < 0 || ioctl(cl->sock, SIOCOUTQ, &outq) < 0)
+		return 0;
+	return outq;
+}
+
+/*
+ * How long this client's update has to wait, in usec: 0 means send now,
+ * -1 means there is nothing to send. Called by the event loop.
+ *
+ * Nothing is queued for a client which hasn't asked for it or still has
+ * the previous update in its socket: new damage merges into the pending
+ * region and a slow viewer gets the newest screen once it is ready,
+ * never a replay of everything in between.
+ */
+long vcClientUpdateDelay(rfbClientPtr cl, long long now)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	long long due;
+
+	if (cl->onHold || !FB_UPDATE_PENDING(cl)) {
+		if (vc)
+			vc->pendingSince = 0;
+		return -1;
+	}
+	if (vc == NULL)
+		return 0;
+	/* the window starts with the damage, not with the request */
+	if (vc->pendingSince == 0)
+		vc->pendingSince = now;
+	if (sraRgnEmpty(cl->requestedRegion))
+		return -1;
+
+	due = vc->pendingSince + vc->coalesce;
+	if (due < vc->lastUpdate + vc->interval)
+		due = vc->lastUpdate + vc->interval;
+	if (due > now)
+		return (long)(due - now);
+
+	if (socket_backlog(cl) > VC_OUTQ_MAX) {
+		if (!vc->backlogged) {
+			vc->held++;
+			METRIC_INC(METRIC_UPDATES_HELD);
+		}
+		vc->backlogged = TRUE;
+		return VC_OUTQ_RETRY;
+	}
+	vc->backlogged = FALSE;
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * client.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <rfb/rfb.h>
+
+/* links faster than this are treated as local (bytes per second, usec) */
+#define VC_FAST_BANDWIDTH	(4*1024*1024)
+#define VC_FAST_RTT		5000
+/* and this fast is worth sending uncompressed */
+#define VC_RAW_BANDWIDTH	(32*1024*1024)
+/* below this we go for maximum compression */
+#define VC_SLOW_BANDWIDTH	(256*1024)
+/* bounds of the per-client coalescing window (usec) */
+#define VC_COALESCE_MIN		2000
+#define VC_COALESCE_MAX		200000
+/* a client with this much still unsent in its socket gets no new update:
+ * its damage keeps merging until the link drains (bytes, retry usec) */
+#define VC_OUTQ_MAX		(64*1024)
+#define VC_OUTQ_RETRY		10000
+
+/*
+ * Per-client state, hangs off rfbClientRec.clientData.
+ *
+ * Round trip time is the delay between sending a small update and getting
+ * the next FramebufferUpdateRequest; throughput is measured the same way
+ * for large updates. Both are smoothed and turned into the update policy.
+ */
+typedef struct vncClient {
+	/* measurements */
+	long long updateStart;	/* when the outstanding update was sent, 0 if none */
+	long long encodeStart;	/* displayHook of the update being encoded; it may
+				 * find nothing to send and never get to the end */
+	int bytesBefore;		/* rfbStatGetSentBytes() at encodeStart */
+	int updateBytes;		/* size of the outstanding update */
+	long rtt;			/* usec */
+	long bandwidth;		/* bytes per second */
+	unsigned long updates;
+	unsigned long sharedUpdates;	/* sent by the fan-out path */
+	rfbBool due;			/* to be updated in this event loop pass */
+	long long encodeTime;	/* usec spent in translation + encoding */
+	long lag;			/* usec from first damage to delivery, smoothed */
+	long maxLag;
+	rfbBool backlogged;		/* socket is full, holding updates back */
+	unsigned long held;		/* times it was */
+
+	/* policy */
+	long defer;		/* screen-wide -deferupdate, our baseline */
+	long coalesce;		/* usec to let damage settle before sending */
+	long interval;		/* minimal usec between two updates */
+	long long pendingSince;	/* first unsent damage, 0 if none */
+	long long lastUpdate;
+
+	/* encoding chosen by the client and the one we forced, if any */
+	int clientEncoding;
+	int forcedEncoding;
+	int clientZlibLevel, clientTightLevel;
+	rfbBool slow;
+
+	/* vcRowHash() of each text row as the client last received it and
+	 * as it is about to be sent, 0 if unknown */
+	int height;
+	uint64_t *rowSent;
+	uint64_t *rowPending;
+	unsigned long rowsChecked, rowsReused;
+
+	/* what a client of the text grid pseudo-encoding has, NULL if pixels,
+	 * and the count of SetEncodings messages when it asked for it */
+	struct vcGrid *textGrid;
+	int textGridEncodings;
+} vncClient, *vncClientPtr;
+
+long long vcNow(void);
+const char *vcEncodingName(int encoding);
+
+vncClientPtr vcClientNew(rfbClientPtr cl);
+void vcClientGone(rfbClientPtr cl);
+
+void vcClientUpdateStart(rfbClientPtr cl);
+void vcClientUpdateDone(rfbClientPtr cl);
+void vcClientFilterDamage(rfbClientPtr cl);
+rfbBool vcClientNativeFormat(rfbClientPtr cl);
+long vcClientUpdateDelay(rfbClientPtr cl, long long now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CLIENT_H__ */
@@ -25,8 +25,20 @@
  */
 
 #include <stdarg.h>
+#include <errno.h>
 #include <rfb/keysym.h>
 #include "console.h"
+#include "client.h"
+#include "fanout.h"
+#include "textgrid.h"
+#include "metrics.h"
+#include "probes.h"
+#include "font.h"
+#include "vga_cells.h"
+#include "psf.h"
+
+_Static_assert(VC_FONT_WIDTH<=16 && VC_FONT_HEIGHT<=VC_GLYPH_ROWS,
+	       "vcGlyph cannot hold the compiled in font");
 
 #define MAX_CUT_TEXT_SYMBOLS 65535
 
@@ -49,8 +61,30 @@ unsigned char colourMap16[16*3]={
   /* f white       #ffffff */ 0xff,0xff,0xff
 };
 
+static rfbPixel RGBToPixel(rfbPixelFormat* f,
+			   unsigned char red,unsigned char green,unsigned char blue)
+{
+  return ((rfbPixel)((red*f->redMax+127)/255)<<f->redShift)|
+    ((rfbPixel)((green*f->greenMax+127)/255)<<f->greenShift)|
+    ((rfbPixel)((blue*f->blueMax+127)/255)<<f->blueShift);
+}
+
+void vcSetColour(vncConsolePtr c,int colour,
+		 unsigned char red,unsigned char green,unsigned char blue)
+{
+  rfbScreenInfoPtr s=c->screen;
+  s->colourMap.data.bytes[colour*3+0]=red;
+  s->colourMap.data.bytes[colour*3+1]=green;
+  s->colourMap.data.bytes[colour*3+2]=blue;
+  if(s->serverFormat.trueColour)
+    c->palette[colour]=RGBToPixel(&s->serverFormat,red,green,blue);
+  else
+    c->palette[colour]=colour;
+}
+
 int MakeColourMap16(vncConsolePtr c)
 {
+  int i;
   rfbColourMap* colourMap=&(c->screen->colourMap);
   if(colourMap->count)
     free(colourMap->data.bytes);
@@ -59,35 +93,255 @@ int MakeColourMap16(vncConsolePtr c)
     rfbLog("Unable to allocate mem for colourMap->data.bytes\n");
     return -1;
   }
-  memcpy(colourMap->data.bytes,colourMap16,16*3);
   colourMap->count=16;
   colourMap->is16=FALSE;
-  c->screen->serverFormat.trueColour=FALSE;
+  /* in 32bpp mode the map only feeds our palette, clients never see it */
+  if(c->bpp==1)
+    c->screen->serverFormat.trueColour=FALSE;
+  for(i=0;i<16;i++)
+    vcSetColour(c,i,colourMap16[i*3],colourMap16[i*3+1],colourMap16[i*3+2]);
   return 0;
 }
 
+/* paint a rectangle of the framebuffer with a colour map entry */
+static void vcFillPixels(vncConsolePtr c,int x,int y,int w,int h,
+			 unsigned char colour)
+{
+  rfbScreenInfoPtr s=c->screen;
+  char *b=s->frameBuffer+y*s->paddedWidthInBytes+x*c->bpp;
+  int i,j;
+
+  if(c->bpp==1) {
+    for(j=0;j<h;j++,b+=s->paddedWidthInBytes)
+      memset(b,colour,w);
+  } else {
+    rfbPixel p=vcPixel(c,colour);
+    for(j=0;j<h;j++,b+=s->paddedWidthInBytes)
+      for(i=0;i<w;i++)
+	((uint32_t*)b)[i]=p;
+  }
+}
+
+/* invert a rectangle (cursor, selection): XOR swaps black and white */
+static void vcXorPixels(vncConsolePtr c,int x,int y,int w,int h)
+{
+  rfbScreenInfoPtr s=c->screen;
+  char *b=s->frameBuffer+y*s->paddedWidthInBytes+x*c->bpp;
+  rfbPixel mask=c->palette[0]^c->palette[15];
+  int i,j;
+
+  if(c->bpp==1) {
+    for(j=0;j<h;j++,b+=s->paddedWidthInBytes)
+      for(i=0;i<w;i++)
+	b[i]^=mask;
+  } else {
+    for(j=0;j<h;j++,b+=s->paddedWidthInBytes)
+      for(i=0;i<w;i++)
+	((uint32_t*)b)[i]^=mask;
+  }
+}
+
+/* all damage goes through these three, so that it can be counted */
+static void vcMarkRect(vncConsolePtr c,int x1,int y1,int x2,int y2)
+{
+  METRIC_INC(METRIC_DAMAGE_RECTS);
+  METRIC_ADD(METRIC_DAMAGE_PIXELS,(x2-x1)*(y2-y1));
+  PROBE4(damage,x1,y1,x2,y2);
+  rfbMarkRectAsModified(c->screen,x1,y1,x2,y2);
+}
+
+static void vcFillRect(vncConsolePtr c,int x1,int y1,int x2,int y2,rfbPixel col)
+{
+  vcHideCursor(c);
+  METRIC_INC(METRIC_DAMAGE_RECTS);
+  METRIC_ADD(METRIC_DAMAGE_PIXELS,(x2-x1)*(y2-y1));
+  PROBE4(damage,x1,y1,x2,y2);
+  rfbFillRect(c->screen,x1,y1,x2,y2,col);
+}
+
+static void vcCopyRect(vncConsolePtr c,int x1,int y1,int x2,int y2,int dx,int dy)
+{
+  vcHideCursor(c);
+  METRIC_INC(METRIC_DAMAGE_RECTS);
+  METRIC_ADD(METRIC_DAMAGE_PIXELS,(x2-x1)*(y2-y1));
+  PROBE4(damage,x1,y1,x2,y2);
+  rfbDoCopyRect(c->screen,x1,y1,x2,y2,dx,dy);
+}
+
+/* the Unicode characters the built-in (CP437) font draws, 0 for none */
+static const uint16_t cp437[256]={
+  0x0000,0x263a,0x263b,0x2665,0x2666,0x2663,0x2660,0x2022,
+  0x25d8,0x25cb,0x25d9,0x2642,0x2640,0x266a,0x266b,0x263c,
+  0x25ba,0x25c4,0x2195,0x203c,0x00b6,0x00a7,0x25ac,0x21a8,
+  0x2191,0x2193,0x2192,0x2190,0x221f,0x2194,0x25b2,0x25bc,
+  [0x7f]=0x2302,
+  0x00c7,0x00fc,0x00e9,0x00e2,0x00e4,0x00e0,0x00e5,0x00e7,
+  0x00ea,0x00eb,0x00e8,0x00ef,0x00ee,0x00ec,0x00c4,0x00c5,
+  0x00c9,0x00e6,0x00c6,0x00f4,0x00f6,0x00f2,0x00fb,0x00f9,
+  0x00ff,0x00d6,0x00dc,0x00a2,0x00a3,0x00a5,0x20a7,0x0192,
+  0x00e1,0x00ed,0x00f3,0x00fa,0x00f1,0x00d1,0x00aa,0x00ba,
+  0x00bf,0x2310,0x00ac,0x00bd,0x00bc,0x00a1,0x00ab,0x00bb,
+  0x2591,0x2592,0x2593,0x2502,0x2524,0x2561,0x2562,0x2556,
+  0x2555,0x2563,0x2551,0x2557,0x255d,0x255c,0x255b,0x2510,
+  0x2514,0x2534,0x252c,0x251c,0x2500,0x253c,0x255e,0x255f,
+  0x255a,0x2554,0x2569,0x2566,0x2560,0x2550,0x256c,0x2567,
+  0x2568,0x2564,0x2565,0x2559,0x2558,0x2552,0x2553,0x256b,
+  0x256a,0x2518,0x250c,0x2588,0x2584,0x258c,0x2590,0x2580,
+  0x03b1,0x00df,0x0393,0x03c0,0x03a3,0x03c3,0x00b5,0x03c4,
+  0x03a6,0x0398,0x03a9,0x03b4,0x221e,0x03c6,0x03b5,0x2229,
+  0x2261,0x00b1,0x2265,0x2264,0x2320,0x2321,0x00f7,0x2248,
+  0x00b0,0x2219,0x00b7,0x221a,0x207f,0x00b2,0x25a0,0x00a0
+};
+
+/* and some it has no glyph for, but one that will do */
+static const uint16_t cp437Similar[][2]={
+  {0x2010,'-'},{0x2013,'-'},{0x2014,'-'},{0x2212,'-'},
+  {0x2018,'\''},{0x2019,'\''},{0x201c,'"'},{0x201d,'"'},
+  {0x25cf,0x07},{0x25b6,0x10},{0x25c0,0x11},
+  {0x2713,0xfb},{0x2714,0xfb},{0x2717,'x'},{0x2718,'x'},
+  {0x256d,0xda},{0x256e,0xbf},{0x256f,0xd9},{0x2570,0xc0},
+  {0x03b2,0xe1},{0x03bc,0xe6},{0x2126,0xea},{0x2208,0xee},{0x2205,0xed}
+};
+
+/* what non-ASCII code points fall back to without a glyph */
+#define VC_STAND_IN '?'
+
+typedef struct vcCp437Map {
+  uint16_t ucs;
+  unsigned char ch;
+} vcCp437Map;
+
+static vcCp437Map cp437Map[256+sizeof(cp437Similar)/sizeof(cp437Similar[0])];
+static int cp437MapSize;
+
+static int vcCp437Cmp(const void *a,const void *b)
+{
+  return (int)((const vcCp437Map*)a)->ucs-(int)((const vcCp437Map*)b)->ucs;
+}
+
+/* the reverse of both tables, sorted by code point */
+static void vcCp437Init(void)
+{
+  int i,n=0;
+
+  for(i=0;i<256;i++)
+    if(cp437[i]) {
+      cp437Map[n].ucs=cp437[i];
+      cp437Map[n++].ch=i;
+    }
+  for(i=0;i<(int)(sizeof(cp437Similar)/sizeof(cp437Similar[0]));i++) {
+    cp437Map[n].ucs=cp437Similar[i][0];
+    cp437Map[n++].ch=cp437Similar[i][1];
+  }
+  qsort(cp437Map,n,sizeof(cp437Map[0]),vcCp437Cmp);
+  cp437MapSize=n;
+}
+
+/* CP437 character showing code point ucs, 0 if there is none */
+static unsigned char vcUnicodeToCp437(uint32_t ucs)
+{
+  vcCp437Map key,*m;
+
+  if(ucs>=' ' && ucs<0x7f)
+    return ucs;
+  if(ucs>0xffff)
+    return 0;
+  if(!cp437MapSize)
+    vcCp437Init();
+  key.ucs=ucs;
+  m=(vcCp437Map*)bsearch(&key,cp437Map,cp437MapSize,sizeof(key),vcCp437Cmp);
+  return m?m->ch:0;
+}
+
+/* one pass over the cell with the precompiled mask, no per-glyph metrics */
+static void vcDrawGlyph(vncConsolePtr c,int x,int y,const vcGlyph *g,
+			unsigned char foreColour,unsigned char backColour)
+{
+  rfbScreenInfoPtr s=c->screen;
+  char *b=s->frameBuffer+y*s->paddedWidthInBytes+x*c->bpp;
+  rfbPixel fg=vcPixel(c,foreColour),bg=vcPixel(c,backColour);
+  uint16_t bits;
+  int i,j;
+
+  if(c->bpp==1) {
+    for(j=0;j<c->cHeight;j++,b+=s->paddedWidthInBytes)
+      for(i=0,bits=g->row[j];i<c->cWidth;i++,bits<<=1)
+	b[i]=(bits&0x8000)?fg:bg;
+  } else {
+    for(j=0;j<c->cHeight;j++,b+=s->paddedWidthInBytes)
+      for(i=0,bits=g->row[j];i<c->cWidth;i++,bits<<=1)
+	((uint32_t*)b)[i]=(bits&0x8000)?fg:bg;
+  }
+}
+
+/* the cellBuffer code point is drawn from the PSF font, ch from the
+   built-in one if there is none */
+static void vcDrawCell(vncConsolePtr c,int x,int y,unsigned char ch,
+		       uint32_t cell,unsigned char foreColour,
+		       unsigned char backColour)
+{
+  const vcGlyph *g;
+  vcGlyph tmp;
+
+  vcHideCursor(c);
+  METRIC_INC(METRIC_GLYPHS);
+  if((cell&VC_CELL_UCS) && (g=vcPsfGlyph(c->psf,cell&VC_CELL_UCS))) {
+    if(cell&VC_CELL_UNDERLINE) {
+      tmp=*g;
+      tmp.row[c->underlineRow]=0xffff;
+      g=&tmp;
+    }
+    vcDrawGlyph(c,x,y,g,foreColour,backColour);
+    return;
+  }
+  if(c->glyphs) {
+    g=&c->glyphs[(cell&VC_CELL_UNDERLINE?VC_GLYPH_UNDERLINE:VC_GLYPH_PLAIN)*256+ch];
+    vcDrawGlyph(c,x,y,g,foreColour,backColour);
+    return;
+  }
+  vcFillPixels(c,x,y,c->cWidth,c->cHeight,backColour);
+  rfbDrawChar(c->screen,c->font,
+	      x-c->xhot+(c->cWidth-rfbWidthOfChar(c->font,ch))/2,
+	      y+c->cHeight-c->yhot-1,
+	      ch,vcPixel(c,foreColour));
+  if(cell&VC_CELL_UNDERLINE)
+    vcFillPixels(c,x,y+c->underlineRow,c->cWidth,1,foreColour);
+}
+
 void vcDrawOrHideCursor(vncConsolePtr c)
 {
-  int i,j,w=c->screen->paddedWidthInBytes;
-  char *b=c->screen->frameBuffer+c->y*c->cHeight*w+c->x*c->cWidth;
-  for(j=c->cy1;j<c->cy2;j++)
-    for(i=c->cx1;i<c->cx2;i++)
-      b[j*w+i]^=0x0f;
-  rfbMarkRectAsModified(c->screen,
-			c->x*c->cWidth+c->cx1,c->y*c->cHeight+c->cy1,
-			c->x*c->cWidth+c->cx2,c->y*c->cHeight+c->cy2);
+  int x,y;
+
+  if(!c->cursorIsDrawn) {
+    c->drawnX=c->x;
+    c->drawnY=c->y;
+  }
   c->cursorIsDrawn=c->cursorIsDrawn?FALSE:TRUE;
+  /* with a client cursor there is nothing to draw, vcSyncClientCursor()
+     passes it on */
+  if(c->clientCursor)
+    return;
+  x=c->drawnX*c->cWidth;
+  y=c->drawnY*c->cHeight;
+  vcXorPixels(c,x+c->cx1,y+c->cy1,c->cx2-c->cx1,c->cy2-c->cy1);
+  vcMarkRect(c,x+c->cx1,y+c->cy1,x+c->cx2,y+c->cy2);
 }
 
 void vcDrawCursor(vncConsolePtr c)
 {
 //	rfbLog("DrawCursor: %d,%d   is drawn: %d\n",c->x,c->y,c->cursorIsDrawn);
-	if(!c->dontDrawCursor && !c->cursorIsDrawn && (c->y<c->height) && (c->x<c->width)) {
+	if(!c->dontDrawCursor && !c->cursorIsDrawn && !c->viewOffset &&
+	   (c->y<c->height) && (c->x<c->width)) {
 		/* rfbLog("DrawCursor: %d,%d\n",c->x,c->y); */
 		vcDrawOrHideCursor(c);
 	}
 }
 
+/*
+ * Called by everything that draws into the text area, so that the first
+ * drawing operation after an update takes the cursor (and a selection
+ * being marked) out of the pixels and the rest find nothing to do.
+ */
 void vcHideCursor(vncConsolePtr c)
 {
 //	rfbLog("HideCursor: %d,%d   is drawn: %d\n",c->x,c->y,c->cursorIsDrawn);
@@ -97,15 +351,188 @@ void vcHideCursor(vncConsolePtr c)
 		vcDrawOrHideCursor(c);
 }
 
+/*
+ * Composite the cursor into the frame about to be sent: one XOR to take
+ * it off the cell where it was drawn if it moved or was switched off, one
+ * to put it where it is now, however many operations came in between.
+ */
+void vcFlushCursor(vncConsolePtr c)
+{
+	if(c->cursorIsDrawn &&
+	   (c->dontDrawCursor || c->drawnX!=c->x || c->drawnY!=c->y))
+		vcDrawOrHideCursor(c);
+	vcDrawCursor(c);
+}
+
 void vcMakeSureCursorIsDrawn(rfbClientPtr cl)
 {
 	vncConsolePtr c = (vncConsolePtr)cl->screen->screenData;
-	if (!c->dontDrawCursor)
-		vcDrawCursor(c);
+	vcClientUpdateStart(cl);
+	/* already done by vcProcessEvents(), this is for --threaded */
+	if (!c->clientCursor)
+		vcFlushCursor(c);
+}
+
+/*
+ * Hash of what a text row looks like in the framebuffer, cursor included.
+ * 0 means the pixels can't be derived from the text (no attributes, a
+ * selection is being marked or the history is shown instead).
+ */
+uint64_t vcRowHash(vncConsolePtr c,int row)
+{
+  const unsigned char *ch=(unsigned char*)c->screenBuffer+row*c->width;
+  const uint32_t *cell=c->cellBuffer+row*c->width;
+  const unsigned char *attr;
+  uint64_t h=14695981039346656037ULL; /* FNV-1a */
+  int i;
+
+#ifdef USE_ATTRIBUTE_BUFFER
+  if(!c->attributeBuffer || c->currentlyMarking || c->viewOffset)
+    return 0;
+  attr=(unsigned char*)c->attributeBuffer+row*c->width;
+#else
+  return 0;
+#endif
+  for(i=0;i<c->width;i++) {
+    h=(h^ch[i])*1099511628211ULL;
+    h=(h^attr[i])*1099511628211ULL;
+    if(cell[i])
+      h=(h^cell[i])*1099511628211ULL;
+  }
+  if(row==c->drawnY && c->cursorIsDrawn && !c->clientCursor)
+    h=(h^(c->drawnX+1))*1099511628211ULL;
+  return h?h:1;
+}
+
+static void vcFreeCursor(rfbCursorPtr cur)
+{
+  if(cur==NULL)
+    return;
+  free(cur->source);
+  free(cur->mask);
+  free(cur->richSource);
+  free(cur);
+}
+
+/*
+ * The text cursor as an RFB cursor shape: a cell with the hot spot in
+ * its top left corner, and what vcDrawOrHideCursor() would XOR in it
+ * drawn in the default foreground. Or an invisible one.
+ */
+static rfbCursorPtr vcMakeCursor(vncConsolePtr c,rfbBool visible)
+{
+  int stride=(c->cWidth+7)/8,x,y;
+  rfbPixel p=vcPixel(c,7);
+  rfbCursorPtr cur=(rfbCursorPtr)calloc(1,sizeof(rfbCursor));
+
+  if(cur==NULL)
+    return NULL;
+  cur->width=c->cWidth;
+  cur->height=c->cHeight;
+  cur->source=(unsigned char*)calloc(stride*c->cHeight,1);
+  cur->mask=(unsigned char*)calloc(stride*c->cHeight,1);
+  cur->richSource=(unsigned char*)calloc(c->cWidth*c->cHeight,c->bpp);
+  if(!cur->source || !cur->mask || !cur->richSource) {
+    vcFreeCursor(cur);
+    return NULL;
+  }
+  for(y=c->cy1;visible && y<c->cy2;y++)
+    for(x=c->cx1;x<c->cx2;x++) {
+      cur->source[y*stride+x/8]|=0x80>>(x%8);
+      cur->mask[y*stride+x/8]|=0x80>>(x%8);
+    }
+  for(x=0;x<c->cWidth*c->cHeight;x++)
+    if(c->bpp==1)
+      cur->richSource[x]=p;
+    else
+      ((uint32_t*)cur->richSource)[x]=p;
+  cur->foreRed=cur->foreGreen=cur->foreBlue=0xc0c0;
+  return cur;
+}
+
+/* keep the cursors, rfbSetCursor() only frees those marked for cleanup */
+int vcEnableClientCursor(vncConsolePtr c)
+{
+  c->textCursor=vcMakeCursor(c,TRUE);
+  c->noCursor=vcMakeCursor(c,FALSE);
+  if(c->textCursor==NULL || c->noCursor==NULL) {
+    rfbLog("Unable to allocate the client cursor\n");
+    vcFreeCursor(c->textCursor);
+    vcFreeCursor(c->noCursor);
+    c->textCursor=c->noCursor=NULL;
+    return -1;
+  }
+  vcHideCursor(c);
+  c->clientCursor=TRUE;
+  rfbSetCursor(c->screen,c->noCursor);
+  return 0;
+}
+
+/* tell the clients where vcDrawCursor() would have drawn the cursor, if
+   anywhere; a move costs them a PointerPos update and no pixels */
+static void vcSyncClientCursor(vncConsolePtr c)
+{
+  rfbScreenInfoPtr s=c->screen;
+  rfbClientIteratorPtr i;
+  rfbClientPtr cl;
+  rfbCursorPtr shape;
+  rfbBool moved;
+
+  vcFlushCursor(c);
+  shape=c->cursorIsDrawn?c->textCursor:c->noCursor;
+  if(s->cursor!=shape)
+    rfbSetCursor(s,shape);
+  moved=c->cursorIsDrawn &&
+    (s->cursorX!=c->x*c->cWidth || s->cursorY!=c->y*c->cHeight);
+  if(moved) {
+    s->cursorX=c->x*c->cWidth;
+    s->cursorY=c->y*c->cHeight;
+  }
+  i=rfbGetClientIterator(s);
+  while((cl=rfbClientIteratorNext(i))) {
+    vncClientPtr vc=(vncClientPtr)cl->clientData;
+    /* the text grid carries the cursor itself */
+    if(vc && vc->textGrid)
+      continue;
+    /* one that can't be told where the cursor is would draw it at its own
+       mouse pointer: libvncserver puts it into its pixels instead */
+    if(!cl->enableCursorPosUpdates)
+      cl->enableCursorShapeUpdates=FALSE;
+    if(moved)
+      cl->cursorWasMoved=TRUE;
+  }
+  rfbReleaseClientIterator(i);
+}
+
+/* would the text cursor be shown, ignoring the blink state */
+rfbBool vcCursorVisible(vncConsolePtr c)
+{
+  return c->cursorActive && !c->dontDrawCursor &&
+    c->x<c->width && c->y<c->height;
+}
+
+static void vcLogScroll(vncConsolePtr c,int top,int bottom,int lines)
+{
+  vcScrollOp *op=&c->scrollLog[c->scrollSeq%VC_SCROLL_LOG];
+  if(!lines)
+    return;
+  METRIC_INC(METRIC_SCROLLS);
+  PROBE3(scroll,top,bottom,lines);
+  op->top=top;
+  op->bottom=bottom;
+  op->lines=lines;
+  c->scrollSeq++;
+}
+
+void vcDisplayFinished(rfbClientPtr cl, int result)
+{
+	(void)result;
+	vcClientUpdateDone(cl);
 }
 
 vncConsolePtr vcGetConsole(int *argc,char **argv,
-			   int width,int height,rfbFontDataPtr font
+			   int width,int height,rfbFontDataPtr font,
+			   rfbBool trueColour
 #ifdef USE_ATTRIBUTE_BUFFER
 			   ,rfbBool withAttributes
 #endif
@@ -118,6 +545,10 @@ vncConsolePtr vcGetConsole(int *argc,char **argv,
   }
 
   c->font=font;
+  c->bpp=trueColour?4:1;
+  c->foreColour=0x7;
+  c->backColour=0;
+  c->rendition=0;
   c->width=width;
   c->height=height;
   c->screenBuffer=(char*)malloc(width*height);
@@ -127,6 +558,13 @@ vncConsolePtr vcGetConsole(int *argc,char **argv,
     return NULL;
   }
   memset(c->screenBuffer,' ',width*height);
+  c->cellBuffer=(uint32_t*)calloc(width*height,sizeof(uint32_t));
+  if (c->cellBuffer == NULL) {
+    rfbLog("Unable to allocate width*height mem for cellBuffer, width = %d, height = %d\n",
+             width, height);
+    return NULL;
+  }
+  c->psf=NULL;
 #ifdef USE_ATTRIBUTE_BUFFER
   if(withAttributes) {
     c->attributeBuffer=(char*)malloc(width*height);
@@ -146,6 +584,10 @@ vncConsolePtr vcGetConsole(int *argc,char **argv,
   c->cursorActive=TRUE;
   c->cursorIsDrawn=FALSE;
   c->dontDrawCursor=FALSE;
+  c->drawnX=c->drawnY=0;
+  c->clientCursor=FALSE;
+  c->textCursor=NULL;
+  c->noCursor=NULL;
   c->inputBuffer=(char*)malloc(1024);
   if (c->inputBuffer == NULL) {
     rfbLog("Unable to allocate mem for inputBuffer\n");
@@ -155,15 +597,32 @@ vncConsolePtr vcGetConsole(int *argc,char **argv,
   c->inputSize=1024;
   c->inputCount=0;
   c->selection=0;
+  c->pasteHook=NULL;
+  c->bracketedPaste=FALSE;
   c->selectTimeOut=40000; /* 40 ms */
+  c->threaded=FALSE;
   c->doEcho=TRUE;
 
   c->wasRightButtonDown=FALSE;
   c->currentlyMarking=FALSE;
 
+  c->scrollback=NULL;
+  c->viewOffset=0;
+  c->historyRow=NULL;
+  c->scrollSeq=0;
+
   rfbWholeFontBBox(font,&c->xhot,&c->cHeight,&c->cWidth,&c->yhot);
   c->cWidth-=c->xhot;
   c->cHeight=-c->cHeight-c->yhot;
+  c->underlineRow=VC_UNDERLINE_ROW(c->cHeight,c->yhot);
+
+  /* the font compiled in at build time, if this is the one we were given */
+  c->glyphs=NULL;
+  if(c->cWidth==VC_FONT_WIDTH && c->cHeight==VC_FONT_HEIGHT &&
+     vcFontHash(font->data,font->metaData)==VC_FONT_HASH)
+    c->glyphs=vcFontCells;
+  else
+    rfbLog("No precompiled glyphs for this font, using rfbDrawChar\n");
 
   /* text cursor */
   c->cx1=c->cWidth/8;
@@ -175,60 +634,153 @@ vncConsolePtr vcGetConsole(int *argc,char **argv,
   if(c->cy1<0)
     c->cy2=0;
 
-  if(!(c->screen = rfbGetScreen(argc,argv,c->cWidth*c->width,c->cHeight*c->height,8,1,1)))
+  if(!(c->screen = rfbGetScreen(argc,argv,c->cWidth*c->width,c->cHeight*c->height,
+				8,trueColour?3:1,c->bpp)))
     return NULL;
   c->screen->screenData=(void*)c;
   c->screen->displayHook=vcMakeSureCursorIsDrawn;
+  c->screen->displayFinishedHook=vcDisplayFinished;
+  /* coalescing is done per client by vcProcessEvents */
+  c->deferUpdateTime=c->screen->deferUpdateTime*1000L;
+  c->screen->deferUpdateTime=0;
   c->screen->frameBuffer=
-    (char*)malloc(c->screen->width*c->screen->height);
+    (char*)malloc(c->screen->paddedWidthInBytes*c->screen->height);
   if (c->screen->frameBuffer == NULL) {
     rfbLog("Unable to allocate memory for screen frameBuffer, width = %d, height = %d\n",
         width, height);
     return NULL;
   }
-  memset(c->screen->frameBuffer,c->backColour,
-	 c->screen->width*c->screen->height);
   c->screen->kbdAddEvent=vcKbdAddEventProc;
   c->screen->ptrAddEvent=vcPtrAddEventProc;
   c->screen->setXCutText=vcSetXCutTextProc;
+  vcTextGridRegister();
 
   if (MakeColourMap16(c))
     return NULL;
-  c->foreColour=0x7;
-  c->backColour=0;
+  vcFillPixels(c,0,0,c->screen->width,c->screen->height,c->backColour);
 
   return(c);
 }
 
 #include <rfb/rfbregion.h>
 
-/* before using this function, hide the cursor */
+/* exported by libvncserver but not declared in its headers */
+extern rfbClientIteratorPtr rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
+/*
+ * Same as rfbProcessEvents(), except that every client gets its update
+ * when its own policy (see client.c) says so, clients with identical raw
+ * updates share one (see fanout.c), and we only sleep in select until the
+ * earliest update is due.
+ */
+void vcProcessEvents(vncConsolePtr c)
+{
+  rfbScreenInfoPtr s=c->screen;
+  rfbClientIteratorPtr i;
+  rfbClientPtr cl,clPrev,due[VC_FANOUT_MAX];
+  vncClientPtr vc;
+  long long now=vcNow();
+  long usec=c->selectTimeOut,delay;
+  int n=0;
+
+  /* the frame is complete, the cursor goes in before anything is due */
+  if(c->clientCursor)
+    vcSyncClientCursor(c);
+  else
+    vcFlushCursor(c);
+  i=rfbGetClientIterator(s);
+  while((cl=rfbClientIteratorNext(i))) {
+    delay=vcClientUpdateDelay(cl,now);
+    if(delay>=0 && delay<usec)
+      usec=delay;
+  }
+  rfbReleaseClientIterator(i);
+
+  rfbCheckFds(s,usec);
+  rfbHttpCheckFds(s);
+
+  now=vcNow();
+  i=rfbGetClientIterator(s);
+  while((cl=rfbClientIteratorNext(i))) {
+    if(vcClientUpdateDelay(cl,now)!=0 || !(vc=(vncClientPtr)cl->clientData))
+      continue;
+    if(vcTextGridUpdate(cl))
+      continue;
+    vcClientFilterDamage(cl);
+    vc->due=TRUE;
+    if(n<VC_FANOUT_MAX)
+      due[n++]=cl;
+  }
+  rfbReleaseClientIterator(i);
+  vcFanoutUpdate(c,due,n);
+
+  i=rfbGetClientIteratorWithClosed(s);
+  cl=rfbClientIteratorHead(i);
+  while(cl) {
+    vc=(vncClientPtr)cl->clientData;
+    if(vc==NULL || vc->due) {
+      if(vc)
+        vc->due=FALSE;
+      rfbUpdateClient(cl);
+    }
+    clPrev=cl;
+    cl=rfbClientIteratorNext(i);
+    if(clPrev->sock==-1)
+      rfbClientConnectionGone(clPrev);
+  }
+  rfbReleaseClientIterator(i);
+}
+
+/*
+ * Keep the top lines which are about to leave the screen. Only lines
+ * leaving a full screen scroll region are history, the ones scrolled out
+ * of a partial region belong to an application.
+ */
+static void vcPushHistory(vncConsolePtr c,int lines)
+{
+  int y;
+
+  if(!c->scrollback || c->sstart!=0 || c->sheight!=c->height)
+    return;
+  if(lines>c->height)
+    lines=c->height;
+  for(y=0;y<lines;y++)
+    vcScrollbackPush(c->scrollback,c->screenBuffer+y*c->width,
+#ifdef USE_ATTRIBUTE_BUFFER
+		     c->attributeBuffer?c->attributeBuffer+y*c->width:
+#endif
+		     NULL);
+}
+
 void vcScroll(vncConsolePtr c,int lineCount)
 {
   if(lineCount==0)
     return;
 
   /* rfbLog("begin scroll\n"); */
-//  vcHideCursor(c);
-//  c->dontDrawCursor=TRUE;
 
   if(lineCount>=(c->sheight - c->sstart)
 		  || lineCount<=- (c->sheight - c->sstart))
   {
+	  if(lineCount>0)
+		  vcPushHistory(c,lineCount);
 	  // Nothing to really scroll - just clear a viewport
 	  memset( c->screenBuffer + c->sstart * c->width,
-			  '.',
+			  ' ',
 			  ( c->sheight - c->sstart ) * c->width);
+	  memset( c->cellBuffer + c->sstart * c->width,
+			  0,
+			  ( c->sheight - c->sstart ) * c->width * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 	  if( c->attributeBuffer )
 		  memset( c->attributeBuffer + c->sstart * c->width,
 				  0x07,
 				  ( c->sheight - c->sstart ) * c->width);
 #endif
-	  rfbFillRect( c->screen,
-				   0, c->sstart * c->cHeight,
-				   c->screen->width, c->sheight * c->cHeight,
-				   c->backColour);
+	  vcFillRect( c,
+				  0, c->sstart * c->cHeight,
+				  c->screen->width, c->sheight * c->cHeight,
+				  vcPixel(c,c->backColour));
 	  return;
   }
   if(lineCount>0)
@@ -237,6 +789,82 @@ void vcScroll(vncConsolePtr c,int lineCount)
 	  vcInsertLines( c, c->sstart, -lineCount );
 }
 
+int vcEnableScrollback(vncConsolePtr c,size_t budget)
+{
+  c->scrollback=vcScrollbackNew(c->width,budget);
+  c->historyRow=(char*)malloc(2*c->width);
+  if(c->scrollback==NULL || c->historyRow==NULL) {
+    rfbLog("Unable to allocate %zu bytes of scrollback\n",budget);
+    vcScrollbackFree(c->scrollback);
+    c->scrollback=NULL;
+    free(c->historyRow);
+    c->historyRow=NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int vcLoadFont(vncConsolePtr c,const char *path)
+{
+  c->psf=vcPsfOpen(path,c->cWidth,c->cHeight);
+  if(c->psf==NULL) {
+    rfbLog("Unable to load PSF2 font %s: %s\n",path,strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* draw screen row y as it looks c->viewOffset lines back in history */
+static void vcDrawHistoryRow(vncConsolePtr c,int y)
+{
+  char *chars,*attrs;
+  uint32_t *cells=NULL;
+  int x;
+
+  if(y<c->viewOffset) {
+    chars=c->historyRow;
+    attrs=c->historyRow+c->width;
+    if(vcScrollbackGet(c->scrollback,c->viewOffset-y,chars,attrs)) {
+      memset(chars,' ',c->width);
+      memset(attrs,0x07,c->width);
+    }
+  } else {
+    chars=c->screenBuffer+(y-c->viewOffset)*c->width;
+    cells=c->cellBuffer+(y-c->viewOffset)*c->width;
+    attrs=NULL;
+#ifdef USE_ATTRIBUTE_BUFFER
+    attrs=c->attributeBuffer?c->attributeBuffer+(y-c->viewOffset)*c->width:NULL;
+#endif
+  }
+  for(x=0;x<c->width;x++) {
+    unsigned char colour=attrs?attrs[x]:c->foreColour|(c->backColour<<4);
+    vcDrawCell(c,x*c->cWidth,y*c->cHeight,chars[x],cells?cells[x]:0,
+	       colour&0x0f,colour>>4);
+  }
+}
+
+/*
+ * Move the view lineCount lines back into history (negative: towards the
+ * live screen). The buffers are not touched, only the framebuffer; any
+ * output snaps the view back first.
+ */
+void vcScrollHistory(vncConsolePtr c,int lineCount)
+{
+  int y,offset=c->viewOffset+lineCount;
+
+  if(offset>vcScrollbackRows(c->scrollback))
+    offset=vcScrollbackRows(c->scrollback);
+  if(offset<0)
+    offset=0;
+  if(offset==c->viewOffset)
+    return;
+
+  c->viewOffset=offset;
+  for(y=0;y<c->height;y++)
+    vcDrawHistoryRow(c,y);
+  vcMarkRect(c,0,0,c->screen->width,c->screen->height);
+}
+
 void vcCheckCoordinates(vncConsolePtr c)
 {
 	if(c->x>=c->width) {
@@ -267,41 +895,47 @@ void vcInsertLines(vncConsolePtr c, int from, int f)
 
 	g = c->sheight - from - f;
 	y = from * c->cHeight;
-	vcHideCursor(c);
+	vcLogScroll(c, from, c->sheight, -f);
 	if( g > 0 )
 	{
 		memmove(c->screenBuffer + (from + f) * c->width,
 				c->screenBuffer + from * c->width,
 				g * c->width);
+		memmove(c->cellBuffer + (from + f) * c->width,
+				c->cellBuffer + from * c->width,
+				g * c->width * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 		if( c->attributeBuffer )
 			memmove(c->attributeBuffer + (from + f) * c->width,
 					c->attributeBuffer + from * c->width,
 					g * c->width);
 #endif
-		rfbDoCopyRect( c->screen,
-					   0, (from + f) * c->cHeight,
-					   c->screen->width,
-					   c->sheight * c->cHeight,
-					   0, f * c->cHeight);
+		vcCopyRect( c,
+					0, (from + f) * c->cHeight,
+					c->screen->width,
+					c->sheight * c->cHeight,
+					0, f * c->cHeight);
 	}
 	// Fill inserted line(s) with spaces
 	memset(c->screenBuffer + from * c->width,
 		   ' ',
 		   f * c->width);
+	memset(c->cellBuffer + from * c->width,
+		   0,
+		   f * c->width * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 	if(c->attributeBuffer)
-		memset(c->screenBuffer + from * c->width,
+		memset(c->attributeBuffer + from * c->width,
 			   0x07,
 			   f * c->width);
 #endif
 	y2 = y + f * c->cHeight;
 	if ( y2 > c->screen->height )
 		y2 = c->screen->height;
-	rfbFillRect( c->screen,
-				 0, y,
-				 c->screen->width, y2,
-				 c->backColour);
+	vcFillRect( c,
+				0, y,
+				c->screen->width, y2,
+				vcPixel(c,c->backColour));
 }
 
 void vcDeleteLines(vncConsolePtr c, int from, int f)
@@ -318,77 +952,88 @@ void vcDeleteLines(vncConsolePtr c, int from, int f)
 
 	g = c->sheight - from - f;
 	y = from * c->cHeight;
-	vcHideCursor(c);
+	if (from == 0)
+		vcPushHistory(c, f);
+	vcLogScroll(c, from, c->sheight, f);
 	if( g > 0 )
 	{
 		memmove(c->screenBuffer + from * c->width,
 				c->screenBuffer + (from + f) * c->width,
 				g * c->width);
+		memmove(c->cellBuffer + from * c->width,
+				c->cellBuffer + (from + f) * c->width,
+				g * c->width * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 		if( c->attributeBuffer )
 			memmove(c->attributeBuffer + from * c->width,
 					c->attributeBuffer + (from + f) * c->width,
 					g * c->width);
 #endif
-		rfbDoCopyRect( c->screen,
-					   0, from * c->cHeight,
-					   c->screen->width,
-					   (c->sheight - f) * c->cHeight,
-					   0, - f * c->cHeight);
+		vcCopyRect( c,
+					0, from * c->cHeight,
+					c->screen->width,
+					(c->sheight - f) * c->cHeight,
+					0, - f * c->cHeight);
 	}
 	// Fill inserted line(s) with spaces
 	memset(c->screenBuffer + (from + g) * c->width,
 		   ' ',
 		   f * c->width);
+	memset(c->cellBuffer + (from + g) * c->width,
+		   0,
+		   f * c->width * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 	if(c->attributeBuffer)
-		memset(c->screenBuffer + (from + g) * c->width,
+		memset(c->attributeBuffer + (from + g) * c->width,
 			   0x07,
 			   f * c->width);
 #endif
-	rfbFillRect( c->screen,
-				 0, y + g * c->cHeight,
-				 c->screen->width, c->sheight * c->cHeight,
-				 c->backColour);
+	vcFillRect( c,
+				0, y + g * c->cHeight,
+				c->screen->width, c->sheight * c->cHeight,
+				vcPixel(c,c->backColour));
 }
 
 void vcDeleteCharacters(vncConsolePtr c, int f)
 {
 	int g, x, y;
 
-	if (f > c->width)
-		f = c->width;
+	if (f > c->width - c->x)
+		f = c->width - c->x;
 
 	g = c->width - c->x - f;
 	x = c->x * c->cWidth;
 	y = c->y * c->cHeight;
 
-	vcHideCursor(c);
 	if (g > 0)
 	{
 		memmove(c->screenBuffer + c->y * c->width + c->x,
 			   c->screenBuffer + c->y * c->width + c->x + f,
 			   g);
+		memmove(c->cellBuffer + c->y * c->width + c->x,
+			   c->cellBuffer + c->y * c->width + c->x + f,
+			   g * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 		if( c->attributeBuffer )
 			memmove(c->attributeBuffer + c->y * c->width + c->x,
 				   c->attributeBuffer + c->y * c->width + c->x + f,
 				   g);
 #endif
-		rfbDoCopyRect( c->screen,
-					   x, y,
-					   c->screen->width - f * c->cWidth, y + c->cHeight,
-					   - f * c->cWidth, 0);
+		vcCopyRect( c,
+					x, y,
+					c->screen->width - f * c->cWidth, y + c->cHeight,
+					- f * c->cWidth, 0);
 	}
-	memset( c->screenBuffer + c->y * c->width + g, ' ', f );
+	memset( c->screenBuffer + c->y * c->width + c->x + g, ' ', f );
+	memset( c->cellBuffer + c->y * c->width + c->x + g, 0, f * sizeof(uint32_t) );
 #ifdef USE_ATTRIBUTE_BUFFER
 	if( c->attributeBuffer )
-		memset( c->attributeBuffer + c->y * c->width + g, 0x07, f );
+		memset( c->attributeBuffer + c->y * c->width + c->x + g, 0x07, f );
 #endif
-	rfbFillRect( c->screen,
-				 x + g * c->cWidth, y,
-				 c->screen->width, y + c->cHeight,
-				 c->backColour);
+	vcFillRect( c,
+				x + g * c->cWidth, y,
+				c->screen->width, y + c->cHeight,
+				vcPixel(c,c->backColour));
 }
 
 void vcInsertCharacters(vncConsolePtr c, int f)
@@ -398,10 +1043,12 @@ void vcInsertCharacters(vncConsolePtr c, int f)
 	g = c->width - c->x - f;
 	if( g > 0 )
 	{
-		vcHideCursor(c);
 		memmove(c->screenBuffer + c->y * c->width + c->x + f,
 				c->screenBuffer + c->y * c->width + c->x,
 				g);
+		memmove(c->cellBuffer + c->y * c->width + c->x + f,
+				c->cellBuffer + c->y * c->width + c->x,
+				g * sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 		if( c->attributeBuffer )
 			memmove(c->attributeBuffer + c->y * c->width + c->x + f,
@@ -410,22 +1057,56 @@ void vcInsertCharacters(vncConsolePtr c, int f)
 #endif
 		x = c->x * c->cWidth;
 		y = c->y * c->cHeight;
-		rfbDoCopyRect( c->screen,
-					   x + f * c->cWidth, y,
-					   c->screen->width,
-					   y + c->cHeight,
-					   f * c->cWidth, 0);
+		vcCopyRect( c,
+					x + f * c->cWidth, y,
+					c->screen->width,
+					y + c->cHeight,
+					f * c->cWidth, 0);
 	}
 	// TODO: Should we put f*' ' here or rely on the fact that client will provide
 	// proper ones after insert request?
 }
 
+/* write one printable cell at the cursor and advance it */
+static void vcPutCell(vncConsolePtr c,unsigned char ch,uint32_t ucs,
+		      unsigned char foreColour,unsigned char backColour)
+{
+  uint32_t cell=ucs|c->rendition;
+  int x,y,pos;
+
+  vcCheckCoordinates(c);
+  pos=c->x+c->y*c->width;
+#ifdef USE_ATTRIBUTE_BUFFER
+  if(c->attributeBuffer) {
+    unsigned char colour=foreColour|(backColour<<4);
+    unsigned char old=c->attributeBuffer[pos];
+    /* The framebuffer already shows this cell: nothing to draw, nothing
+       to mark as modified and nothing to encode. Blanks only depend on
+       the background. */
+    if((unsigned char)c->screenBuffer[pos]==ch && c->cellBuffer[pos]==cell &&
+       (old==colour || (ch==' ' && !cell && (old>>4)==backColour))) {
+      c->attributeBuffer[pos]=colour;
+      c->x++;
+      return;
+    }
+    c->attributeBuffer[pos]=colour;
+  }
+#endif
+  x=c->x*c->cWidth;
+  y=c->y*c->cHeight;
+  vcDrawCell(c,x,y,ch,cell,foreColour,backColour);
+  c->screenBuffer[pos]=ch;
+  c->cellBuffer[pos]=cell;
+  c->x++;
+  vcMarkRect(c,x,y-c->cHeight+1,x+c->cWidth,y+c->cHeight+1);
+}
+
 void vcPutChar(vncConsolePtr c,unsigned char ch)
 {
 #ifdef USE_ATTRIBUTE_BUFFER
   if(c->attributeBuffer) {
     unsigned char colour=c->attributeBuffer[c->x+c->y*c->width];
-    vcPutCharColour(c,ch,colour&0x7,colour>>4);
+    vcPutCharColour(c,ch,colour&0x0f,colour>>4);
   } else
 #endif
     vcPutCharColour(c,ch,c->foreColour,c->backColour);
@@ -433,10 +1114,6 @@ void vcPutChar(vncConsolePtr c,unsigned char ch)
 
 void vcPutCharColour(vncConsolePtr c,unsigned char ch,unsigned char foreColour,unsigned char backColour)
 {
-  rfbScreenInfoPtr s=c->screen;
-  int j,x,y;
-
-  vcHideCursor(c);
   if(ch<' ') {
     switch(ch) {
     case 13:
@@ -465,24 +1142,29 @@ void vcPutCharColour(vncConsolePtr c,unsigned char ch,unsigned char foreColour,u
        rfbLog("putchar of unknown character: %c(%d).\n",ch,ch);
       vcPutChar(c,' ');
     }
-  } else {
-    vcCheckCoordinates(c);
-#ifdef USE_ATTRIBUTE_BUFFER
-    if(c->attributeBuffer)
-      c->attributeBuffer[c->x+c->y*c->width]=foreColour|(backColour<<4);
-#endif
-    x=c->x*c->cWidth;
-    y=c->y*c->cHeight;
-    for(j=y+c->cHeight-1;j>=y;j--)
-      memset(s->frameBuffer+j*s->width+x,backColour,c->cWidth);
-    rfbDrawChar(s,c->font,
-		x-c->xhot+(c->cWidth-rfbWidthOfChar(c->font,ch))/2,
-		y+c->cHeight-c->yhot-1,
-		ch,foreColour);
-    c->screenBuffer[c->y*c->width+c->x]=ch;
-    c->x++;
-    rfbMarkRectAsModified(s,x,y-c->cHeight+1,x+c->cWidth,y+c->cHeight+1);
+  } else
+    vcPutCell(c,ch,0,foreColour,backColour);
+}
+
+/*
+ * A code point decoded from UTF-8: the built-in font's character if it
+ * has one, else the PSF font's glyph with a stand-in for the text
+ * consumers, else just the stand-in.
+ */
+void vcPutUnicodeColour(vncConsolePtr c,uint32_t ucs,
+			unsigned char foreColour,unsigned char backColour)
+{
+  unsigned char ch;
+
+  if(ucs<0x80) {
+    vcPutCharColour(c,ucs,foreColour,backColour);
+    return;
   }
+  if((ch=vcUnicodeToCp437(ucs)))
+    vcPutCell(c,ch,0,foreColour,backColour);
+  else
+    vcPutCell(c,VC_STAND_IN,vcPsfHas(c->psf,ucs)?ucs:0,
+	      foreColour,backColour);
 }
 
 void vcKbdAddEventProc(rfbBool down,rfbKeySym keySym,rfbClientPtr cl)
@@ -515,7 +1197,9 @@ void vcPtrAddEventProc(int buttonMask,int x,int y,rfbClientPtr cl)
 
   if(c->wasRightButtonDown) {
     if((buttonMask&4)==0) {
-      if(c->selection) {
+      if(c->selection && c->pasteHook)
+	c->pasteHook(c,c->selection,strlen(c->selection));
+      else if(c->selection) {
 	char* s;
 	for(s=c->selection;*s;s++) {
 	  c->screen->kbdAddEvent(1,*s,cl);
@@ -527,7 +1211,7 @@ void vcPtrAddEventProc(int buttonMask,int x,int y,rfbClientPtr cl)
   } else if(buttonMask&4)
     c->wasRightButtonDown=1;
 
-  if(buttonMask&1) {
+  if((buttonMask&1) && !c->viewOffset) {
     int cx=x/c->cWidth,cy=y/c->cHeight,pos;
     if(cx<0) cx=0; else if(cx>=c->width) cx=c->width-1;
     if(cy<0) cy=0; else if(cy>=c->height) cy=c->height-1;
@@ -582,7 +1266,12 @@ void vcPtrAddEventProc(int buttonMask,int x,int y,rfbClientPtr cl)
     vcUnmark(c);
     rfbGotXCutText(c->screen,c->selection,j-i);
   }
-  rfbDefaultPtrAddEvent(buttonMask,x,y,cl);
+  /* the cursor is the text cursor, not the mouse pointer: put it back
+     where it belongs on the client that moved it */
+  if(c->clientCursor)
+    cl->cursorWasMoved=TRUE;
+  else
+    rfbDefaultPtrAddEvent(buttonMask,x,y,cl);
 }
 
 void vcSetXCutTextProc(char* str,int len, struct _rfbClientRec* cl)
@@ -611,13 +1300,8 @@ void vcToggleMarkCell(vncConsolePtr c,int pos)
 {
   int x=(pos%c->width)*c->cWidth,
     y=(pos/c->width)*c->cHeight;
-  int i,j;
-  rfbScreenInfoPtr s=c->screen;
-  char *b=s->frameBuffer+y*s->width+x;
-  for(j=0;j<c->cHeight;j++)
-    for(i=0;i<c->cWidth;i++)
-      b[j*s->width+i]^=0x0f;
-  rfbMarkRectAsModified(c->screen,x,y,x+c->cWidth,y+c->cHeight);
+  vcXorPixels(c,x,y,c->cWidth,c->cHeight);
+  vcMarkRect(c,x,y,x+c->cWidth,y+c->cHeight);
 }
 
 void vcUnmark(vncConsolePtr c)
@@ -633,18 +1317,32 @@ void vcUnmark(vncConsolePtr c)
     vcToggleMarkCell(c,i);
 }
 
-/* before using this function, hide the cursor */
+/* blank the whole screen, text and pixels, in a colour map entry */
+void vcClearScreen(vncConsolePtr c,unsigned char colour)
+{
+	vcFillRect(c,0,0,c->screen->width,c->screen->height,vcPixel(c,colour));
+	memset(c->screenBuffer,' ',c->width*c->height);
+	memset(c->cellBuffer,0,c->width*c->height*sizeof(uint32_t));
+#ifdef USE_ATTRIBUTE_BUFFER
+	if(c->attributeBuffer)
+		memset(c->attributeBuffer,0x07,c->width*c->height);
+#endif
+}
+
 void vcReset(vncConsolePtr c)
 {
 	int y1,y2;
 	rfbScreenInfoPtr s = c->screen;
 
+	vcHideCursor(c);
 	y1 = s->height - c->height * c->cHeight;
 	y2 = s->height;
-	memset(s->frameBuffer + y1 * s->width, c->backColour, (y2-y1) * s->width);
-	rfbMarkRectAsModified(s, 0, y1-c->cHeight, s->width, y2);
+	vcFillPixels(c, 0, y1, s->width, y2-y1, c->backColour);
+	vcMarkRect(c, 0, y1-c->cHeight, s->width, y2);
 	memset(c->screenBuffer + y1/c->cHeight*c->width, ' ',
 		(y2-y1)/c->cHeight*c->width);
+	memset(c->cellBuffer + y1/c->cHeight*c->width, 0,
+		(y2-y1)/c->cHeight*c->width*sizeof(uint32_t));
 #ifdef USE_ATTRIBUTE_BUFFER
 	if(c->attributeBuffer)
 		memset(c->attributeBuffer+y1/c->cHeight*c->width,0x07,
@@ -32,6 +32,7 @@ extern "C" {
 #endif
 
 #include <rfb/rfb.h>
+#include "scrollback.h"
 
 /*
  *  * Possible attributes.
@@ -60,6 +61,17 @@ extern "C" {
 /* this is now the default */
 #define USE_ATTRIBUTE_BUFFER
 
+/* cellBuffer entries */
+#define VC_CELL_UCS		0x001fffff
+#define VC_CELL_UNDERLINE	0x01000000
+
+/* recent line scrolls, for the text consumers (see grid.h) */
+#define VC_SCROLL_LOG 64
+
+typedef struct vcScrollOp {
+  int top, bottom, lines;
+} vcScrollOp;
+
 typedef struct vncConsole {
   /* width and height in cells (=characters) */
   int width, height;
@@ -69,6 +81,10 @@ typedef struct vncConsole {
 
   /* characters */
   char *screenBuffer;
+  /* what else there is to each cell: the code point if it is drawn from
+     the PSF font, 0 where it is the CP437 character in screenBuffer (which
+     otherwise holds a stand-in), and renditions colours don't show */
+  uint32_t *cellBuffer;
 
 #ifdef USE_ATTRIBUTE_BUFFER
   /* attributes: colours. If NULL, default to gray on black, else
@@ -88,6 +104,13 @@ typedef struct vncConsole {
 
   /* colour */
   unsigned char foreColour,backColour;
+  /* VC_CELL_* renditions of the characters put from now on */
+  uint32_t rendition;
+  int underlineRow;
+  /* framebuffer pixel size in bytes (1 or 4) and the pixel value of each
+     colour map entry: the index itself in 8bpp mode, true colour in 32bpp */
+  int bpp;
+  rfbPixel palette[16];
   int8_t cx1,cy1,cx2,cy2;
 
   /* input buffer */
@@ -95,36 +118,74 @@ typedef struct vncConsole {
   int inputCount;
   int inputSize;
   long selectTimeOut;
+  long deferUpdateTime; /* usec, baseline of per-client coalescing */
+  /* clients are served by libvncserver's own threads, not by
+     vcProcessEvents(): no per-client policy, fan-out or text grid */
+  rfbBool threaded;
   rfbBool doEcho; /* if reading input, do output directly? */
 
   /* selection */
   char *selection;
+  /* if set, pastes go here instead of one key event per character */
+  void (*pasteHook)(struct vncConsole *c,const char *text,int len);
+  rfbBool bracketedPaste; /* DEC mode 2004 */
 
   /* mouse */
   rfbBool wasRightButtonDown;
   rfbBool currentlyMarking;
   int markStart,markEnd;
 
-  /* should text cursor be drawn? (an underscore at current position) */
+  /* should text cursor be drawn? (an underscore at current position)
+     x, y and dontDrawCursor say where it is; the framebuffer only gets it
+     from vcFlushCursor(), at drawnX, drawnY while cursorIsDrawn */
   rfbBool cursorActive;
   rfbBool cursorIsDrawn;
-  rfbBool dontDrawCursor; /* for example, while scrolling */
+  rfbBool dontDrawCursor; /* DEC mode 25 */
+  int drawnX,drawnY;
+  /* the clients draw the text cursor themselves, from a cursor shape and
+     PointerPos updates: it never touches the framebuffer */
+  rfbBool clientCursor;
+  rfbCursorPtr textCursor,noCursor;
+
+  /* rows scrolled off the top, and how many of them are being viewed
+     (0 means the framebuffer shows the live screen) */
+  vcScrollbackPtr scrollback;
+  int viewOffset;
+  char *historyRow;
+
+  /* scrollLog[n%VC_SCROLL_LOG] is the n-th scroll, scrollSeq the next n */
+  unsigned long scrollSeq;
+  vcScrollOp scrollLog[VC_SCROLL_LOG];
 
   rfbFontDataPtr font;
+  /* font laid out at build time (font.h), NULL to draw with rfbDrawChar */
+  const struct vcGlyph *glyphs;
+  /* for what CP437 doesn't have, NULL if none */
+  struct vcPsf *psf;
   rfbScreenInfoPtr screen;
 } vncConsole, *vncConsolePtr;
 
+/* framebuffer pixel value of a colour map index */
+#define vcPixel(c,colour) ((c)->palette[(colour)&0x0f])
+
 #ifdef USE_ATTRIBUTE_BUFFER
 vncConsolePtr vcGetConsole(int *argc,char **argv,
 			   int width,int height,rfbFontDataPtr font,
-			   rfbBool withAttributes);
+			   rfbBool trueColour,rfbBool withAttributes);
 #else
 vncConsolePtr vcGetConsole(int *argc,char **argv,
-			   int width,int height,rfbFontDataPtr font);
+			   int width,int height,rfbFontDataPtr font,
+			   rfbBool trueColour);
 #endif
+void vcSetColour(vncConsolePtr c,int colour,
+		 unsigned char red,unsigned char green,unsigned char blue);
+uint64_t vcRowHash(vncConsolePtr c,int row);
+rfbBool vcCursorVisible(vncConsolePtr c);
 void vcDrawCursor(vncConsolePtr c);
 void vcHideCursor(vncConsolePtr c);
+void vcFlushCursor(vncConsolePtr c);
 void vcCheckCoordinates(vncConsolePtr c);
+int vcEnableClientCursor(vncConsolePtr c);
 
 void vcPutChar(vncConsolePtr c,unsigned char ch);
 void vcPrint(vncConsolePtr c,unsigned char* str);
@@ -136,6 +197,9 @@ void vcPrintColour(vncConsolePtr c,unsigned char* str,
 		   unsigned char foreColour,unsigned char backColour);
 void vcPrintFColour(vncConsolePtr c,unsigned char foreColour,
 		    unsigned char backColour,char* format,...);
+void vcPutUnicodeColour(vncConsolePtr c,uint32_t ucs,
+			unsigned char foreColour,unsigned char backColour);
+int vcLoadFont(vncConsolePtr c,const char *path);
 
 char vcGetCh(vncConsolePtr c);
 char vcGetChar(vncConsolePtr c); /* blocking */
@@ -155,9 +219,12 @@ void vcUnmark(vncConsolePtr c);
 
 void vcProcessEvents(vncConsolePtr c);
 
-/* before using this function, hide the cursor */
+int vcEnableScrollback(vncConsolePtr c,size_t budget);
+void vcScrollHistory(vncConsolePtr c,int lineCount);
+
 void vcScroll(vncConsolePtr c,int lineCount);
 void vcReset(vncConsolePtr c);
+void vcClearScreen(vncConsolePtr c,unsigned char colour);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,175 @@
+/*
+ * delta.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "client.h"
+#include "grid.h"
+#include "delta.h"
+
+struct subscriber {
+	int fd;
+	vcGridPtr grid;
+	size_t len, sent, size;
+	unsigned char *buf;
+};
+
+static int delta_fd = -1;
+static char delta_path[PATH_MAX];
+static struct subscriber *subs[DELTA_MAX_CLIENTS];
+static long long last_frame;
+static uint32_t frame;
+
+static void drop(int i)
+{
+	close(subs[i]->fd);
+	vcGridFree(subs[i]->grid);
+	free(subs[i]->buf);
+	free(subs[i]);
+	subs[i] = NULL;
+}
+
+/* returns -1 if the subscriber is gone */
+static int flush(struct subscriber *s)
+{
+	ssize_t sz;
+
+	while (s->sent < s->len) {
+		sz = send(s->fd, s->buf + s->sent, s->len - s->sent,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sz < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		s->sent += sz;
+	}
+	s->len = s->sent = 0;
+	return 0;
+}
+
+static void accept_new(vncConsolePtr c)
+{
+	struct subscriber *s;
+	int fd, i;
+
+	while ((fd = accept(delta_fd, NULL, NULL)) >= 0) {
+		for (i = 0; i < DELTA_MAX_CLIENTS && subs[i]; i++)
+			;
+		s = i < DELTA_MAX_CLIENTS ? (struct subscriber *)calloc(1, sizeof(*s)) : NULL;
+		if (s) {
+			/* a frame always fits */
+			s->size = vcGridEncodedMax(c->width, c->height) + 5;
+			s->buf = (unsigned char *)malloc(s->size);
+			s->grid = vcGridNew(c);
+		}
+		if (s == NULL || s->buf == NULL || s->grid == NULL) {
+			vzvnc_logger(VZ_VNC_WARN, "Text delta subscriber refused");
+			if (s) {
+				vcGridFree(s->grid);
+				free(s->buf);
+				free(s);
+			}
+			close(fd);
+			continue;
+		}
+		s->fd = fd;
+		subs[i] = s;
+		/* served right away: the resync is what it came for */
+		last_frame = 0;
+	}
+}
+
+/* Called from the event loop with the console locked. */
+void delta_poll(vncConsolePtr c)
+{
+	struct subscriber *s;
+	unsigned char dummy;
+	uint32_t n;
+	long long now;
+	int i, len;
+
+	if (delta_fd < 0)
+		return;
+	accept_new(c);
+
+	now = vcNow();
+	if (now - last_frame < DELTA_FRAME)
+		return;
+	last_frame = now;
+	frame++;
+
+	for (i = 0; i < DELTA_MAX_CLIENTS; i++) {
+		if ((s = subs[i]) == NULL)
+			continue;
+		/* subscribers have nothing to say, this only detects hangups */
+		if (recv(s->fd, &dummy, 1, MSG_DONTWAIT) == 0 ||
+		    flush(s)) {
+			drop(i);
+			continue;
+		}
+		/* the previous frame is still on its way: skip this one */
+		if (s->len)
+			continue;
+
+		len = vcGridEncode(s->grid, c, s->buf, s->size - 5);
+		if (len <= 0)
+			continue;
+		n = htonl(frame);
+		s->buf[len] = 'F';
+		memcpy(s->buf + len + 1, &n, 4);
+		s->len = len + 5;
+		if (flush(s))
+			drop(i);
+	}
+}
+
+int delta_open(const char *path)
+{
+	if ((delta_fd = listen_unix(path)) < 0)
+		return VZ_VNC_ERR_SOCK;
+	snprintf(delta_path, sizeof(delta_path), "%s", path);
+	vzvnc_logger(VZ_VNC_INFO, "Text deltas served on %s", path);
+	return 0;
+}
+
+void delta_close(void)
+{
+	int i;
+
+	if (delta_fd < 0)
+		return;
+	for (i = 0; i < DELTA_MAX_CLIENTS; i++)
+		if (subs[i])
+			drop(i);
+	close(delta_fd);
+	unlink(delta_path);
+	delta_fd = -1;
+}
@@ -0,0 +1,60 @@
+/*
+ * delta.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "console.h"
+
+/*
+ * Text delta stream: subscribers connect to a Unix socket and get the
+ * screen as cell changes instead of pixels. A subscriber starts with a
+ * resync and the whole screen, then gets one batch of changes per frame
+ * (at most every DELTA_FRAME usec) closed by a frame message.
+ *
+ * Messages are those of vcGridEncode() (see grid.h) plus
+ *   'F' u32 frame                        end of a batch
+ * in network byte order.
+ *
+ * A subscriber which doesn't keep up is not queued for: it skips frames
+ * and gets the screen as it is by the time its socket drains.
+ */
+
+#define DELTA_MAX_CLIENTS	8
+#define DELTA_FRAME		40000
+
+int delta_open(const char *path);
+void delta_poll(vncConsolePtr console);
+void delta_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DELTA_H__ */
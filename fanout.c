@@ -0,0 +1,206 @@
+/*
+ * fanout.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/*
+ * Encode-once updates for several viewers of the same console.
+ *
+ * libvncserver encodes every update separately for each client, and its
+ * compressing encoders keep per-client stream state, so their output can't
+ * be shared. Raw updates in the server's own pixel format can: clients
+ * which use them and have the same damage get one FramebufferUpdate built
+ * per frame, written to every socket from the same buffer.
+ */
+
+#include <string.h>
+
+#include <rfb/rfb.h>
+#include "util.h"
+#include "client.h"
+#include "fanout.h"
+
+static char *payload = NULL;
+static size_t payload_size = 0;
+
+/* clients with nothing but pixels to send, in a format we can copy */
+static rfbBool can_share(rfbClientPtr cl)
+{
+	return cl->clientData != NULL && cl->sock != -1 &&
+		cl->preferredEncoding == rfbEncodingRaw &&
+		cl->enableCursorShapeUpdates && !cl->cursorWasChanged &&
+		!(cl->enableCursorPosUpdates && cl->cursorWasMoved) &&
+		!cl->newFBSizePending && sraRgnEmpty(cl->copyRegion) &&
+		vcClientNativeFormat(cl);
+}
+
+static rfbBool same_region(sraRegionPtr a, sraRegionPtr b)
+{
+	sraRegionPtr tmp = sraRgnCreateRgn(a);
+	rfbBool same = !sraRgnSubtract(tmp, b);
+
+	if (same) {
+		sraRgnMakeEmpty(tmp);
+		sraRgnOr(tmp, b);
+		same = !sraRgnSubtract(tmp, a);
+	}
+	sraRgnDestroy(tmp);
+	return same;
+}
+
+static char *reserve(size_t size)
+{
+	char *p;
+
+	if (size <= payload_size)
+		return payload;
+	p = (char *)realloc(payload, size);
+	if (p == NULL) {
+		rfbLog("Unable to allocate %zu bytes for shared update\n", size);
+		return NULL;
+	}
+	payload = p;
+	payload_size = size;
+	return payload;
+}
+
+/* build the FramebufferUpdate message for a region, returns its length */
+static int build_update(rfbScreenInfoPtr s, sraRegionPtr region)
+{
+	rfbFramebufferUpdateMsg *fu;
+	rfbFramebufferUpdateRectHeader rect;
+	sraRectangleIterator *i;
+	sraRect r;
+	int bpp = s->bitsPerPixel / 8, nrects = 0, y, w;
+	size_t len = sz_rfbFramebufferUpdateMsg;
+	char *p;
+
+	i = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(i, &r)) {
+		len += sz_rfbFramebufferUpdateRectHeader +
+			(size_t)(r.x2 - r.x1) * (r.y2 - r.y1) * bpp;
+		nrects++;
+	}
+	sraRgnReleaseIterator(i);
+	if (nrects == 0 || nrects > 0xffff || reserve(len) == NULL)
+		return 0;
+
+	fu = (rfbFramebufferUpdateMsg *)payload;
+	fu->type = rfbFramebufferUpdate;
+	fu->pad = 0;
+	fu->nRects = Swap16IfLE(nrects);
+	p = payload + sz_rfbFramebufferUpdateMsg;
+
+	i = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(i, &r)) {
+		w = (r.x2 - r.x1) * bpp;
+		rect.r.x = Swap16IfLE(r.x1);
+		rect.r.y = Swap16IfLE(r.y1);
+		rect.r.w = Swap16IfLE(r.x2 - r.x1);
+		rect.r.h = Swap16IfLE(r.y2 - r.y1);
+		rect.encoding = Swap32IfLE(rfbEncodingRaw);
+		memcpy(p, &rect, sz_rfbFramebufferUpdateRectHeader);
+		p += sz_rfbFramebufferUpdateRectHeader;
+		for (y = r.y1; y < r.y2; y++, p += w)
+			memcpy(p, s->frameBuffer + y * s->paddedWidthInBytes +
+					r.x1 * bpp, w);
+	}
+	sraRgnReleaseIterator(i);
+	return len;
+}
+
+/* what rfbSendFramebufferUpdate does to the client once it has sent */
+static void send_shared(rfbClientPtr cl, sraRegionPtr region, int len)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+
+	vcClientUpdateStart(cl);
+	if (rfbWriteExact(cl, payload, len) < 0) {
+		rfbLog("shared update to %s failed\n", cl->host);
+		rfbCloseClient(cl);
+		return;
+	}
+	rfbStatRecordEncodingSent(cl, rfbEncodingRaw, len, len);
+	sraRgnSubtract(cl->modifiedRegion, region);
+	sraRgnMakeEmpty(cl->requestedRegion);
+	vcClientUpdateDone(cl);
+	vc->sharedUpdates++;
+	vc->due = FALSE;
+}
+
+/*
+ * Send one shared update to every group of at least two due clients with
+ * the same damage. Those are no longer due afterwards; the rest is left
+ * to rfbUpdateClient(). All candidates use the server's pixel format, so
+ * the damage is the only thing to compare.
+ */
+void vcFanoutUpdate(vncConsolePtr c, rfbClientPtr *due, int n)
+{
+	rfbScreenInfoPtr s = c->screen;
+	sraRegionPtr region[VC_FANOUT_MAX];
+	int group[VC_FANOUT_MAX];
+	int i, j, members, len;
+
+	if (n > VC_FANOUT_MAX)
+		n = VC_FANOUT_MAX;
+
+	for (i = 0, members = 0; i < n; i++) {
+		region[i] = NULL;
+		group[i] = -1;
+		if (!can_share(due[i]))
+			continue;
+		region[i] = sraRgnCreateRgn(due[i]->modifiedRegion);
+		if (!sraRgnAnd(region[i], due[i]->requestedRegion)) {
+			sraRgnDestroy(region[i]);
+			region[i] = NULL;
+			continue;
+		}
+		members++;
+	}
+	if (members < 2)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (region[i] == NULL || group[i] != -1)
+			continue;
+		for (j = i + 1, members = 1; j < n; j++)
+			if (region[j] && group[j] == -1 &&
+			    same_region(region[i], region[j])) {
+				group[j] = i;
+				members++;
+			}
+		if (members < 2)
+			continue;
+
+		len = build_update(s, region[i]);
+		if (len == 0)
+			continue;
+		send_shared(due[i], region[i], len);
+		for (j = i + 1; j < n; j++)
+			if (group[j] == i)
+				send_shared(due[j], region[j], len);
+	}
+out:
+	for (i = 0; i < n; i++)
+		if (region[i])
+			sraRgnDestroy(region[i]);
+}
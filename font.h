@@ -0,0 +1,85 @@
+/*
+ * font.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __FONT_H__
+#define __FONT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * The console font as tools/fontgen lays it out at build time: one
+ * fixed-size, 16 byte aligned mask per glyph, positioned in its cell the
+ * way rfbDrawChar() would draw it and clipped to the cell, one bit
+ * per pixel with the leftmost pixel in bit 15. Drawing a cell is then
+ * a loop over VC_FONT_HEIGHT rows with no per-glyph metrics at all.
+ *
+ * Renditions that change the shape of a glyph get a variant of the
+ * whole font, 8KB each, so an underlined cell costs no more to draw than
+ * a plain one. Those that only change colours don't need any.
+ */
+
+#define VC_GLYPH_ROWS	16
+
+enum {
+	VC_GLYPH_PLAIN,
+	VC_GLYPH_UNDERLINE,
+	VC_GLYPH_VARIANTS
+};
+
+/* two rows below the baseline, where the font draws '_' */
+#define VC_UNDERLINE_ROW(height, yhot) \
+	((height) - (yhot) + 1 < (height) ? (height) - (yhot) + 1 : (height) - 1)
+
+typedef struct vcGlyph {
+	uint16_t row[VC_GLYPH_ROWS];
+} __attribute__((aligned(16))) vcGlyph;
+
+_Static_assert(sizeof(vcGlyph) % 16 == 0, "glyphs must stay 16 byte aligned");
+
+/* identifies the rfbFontData a table was generated from */
+static inline uint64_t vcFontHash(const unsigned char *data, const int *metaData)
+{
+	uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+	int i, end = 0;
+
+	for (i = 0; i < 256 * 5; i++)
+		h = (h ^ (uint32_t)metaData[i]) * 1099511628211ULL;
+	for (i = 0; i < 256; i++)
+		if (metaData[i * 5] + (metaData[i * 5 + 1] + 7) / 8 * metaData[i * 5 + 2] > end)
+			end = metaData[i * 5] + (metaData[i * 5 + 1] + 7) / 8 * metaData[i * 5 + 2];
+	for (i = 0; i < end; i++)
+		h = (h ^ data[i]) * 1099511628211ULL;
+	return h;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FONT_H__ */
@@ -0,0 +1,275 @@
+/*
+ * grid.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Cell level change detection shared by the text consumers.
+ *
+ * Comparing two 80x24 grids is a few memcmp()s, far cheaper than keeping
+ * a change log of every cell the parser touches. Scrolls are the one
+ * thing a comparison can't see cheaply, so the console logs those
+ * (vcDeleteLines/vcInsertLines) and they are replayed first.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <rfb/rfb.h>
+#include "grid.h"
+
+vcGridPtr vcGridNew(vncConsolePtr c)
+{
+	vcGridPtr g = (vcGridPtr)calloc(1, sizeof(vcGrid));
+
+	if (g == NULL)
+		return NULL;
+	g->width = c->width;
+	g->height = c->height;
+	g->chars = (char *)malloc(2 * c->width * c->height);
+	if (g->chars == NULL) {
+		free(g);
+		return NULL;
+	}
+	g->attrs = g->chars + c->width * c->height;
+	g->valid = FALSE;
+	return g;
+}
+
+void vcGridFree(vcGridPtr g)
+{
+	if (g == NULL)
+		return;
+	free(g->chars);
+	free(g);
+}
+
+static void blank_rows(vcGridPtr g, int row, int n)
+{
+	memset(g->chars + row * g->width, ' ', n * g->width);
+	memset(g->attrs + row * g->width, 0x07, n * g->width);
+}
+
+static void scroll_rows(vcGridPtr g, int top, int bottom, int lines)
+{
+	int n = bottom - top - abs(lines), w = g->width;
+
+	if (n <= 0) {
+		blank_rows(g, top, bottom - top);
+		return;
+	}
+	if (lines > 0) {
+		memmove(g->chars + top * w, g->chars + (top + lines) * w, n * w);
+		memmove(g->attrs + top * w, g->attrs + (top + lines) * w, n * w);
+		blank_rows(g, top + n, lines);
+	} else {
+		memmove(g->chars + (top - lines) * w, g->chars + top * w, n * w);
+		memmove(g->attrs + (top - lines) * w, g->attrs + top * w, n * w);
+		blank_rows(g, top, -lines);
+	}
+}
+
+/* replay the console's scrolls the consumer hasn't seen, if still logged */
+static int replay_scrolls(vcGridPtr g, vncConsolePtr c, const vcGridOps *ops, void *data)
+{
+	unsigned long seq;
+	int n = 0;
+
+	if (c->scrollSeq - g->scrollSeq > VC_SCROLL_LOG) {
+		/* too far behind: the cell diff will catch up */
+		g->scrollSeq = c->scrollSeq;
+		return 0;
+	}
+	for (seq = g->scrollSeq; seq != c->scrollSeq; seq++) {
+		const vcScrollOp *op = &c->scrollLog[seq % VC_SCROLL_LOG];
+
+		scroll_rows(g, op->top, op->bottom, op->lines);
+		ops->scroll(data, op->top, op->bottom, op->lines);
+		n++;
+	}
+	g->scrollSeq = c->scrollSeq;
+	return n;
+}
+
+static int diff_row(vcGridPtr g, int row, const char *chars, const char *attrs,
+		    const vcGridOps *ops, void *data)
+{
+	char *gc = g->chars + row * g->width, *ga = g->attrs + row * g->width;
+	int x = 0, start, end, n = 0;
+
+	if (!memcmp(gc, chars, g->width) && !memcmp(ga, attrs, g->width))
+		return 0;
+
+	while (x < g->width) {
+		if (gc[x] == chars[x] && ga[x] == attrs[x]) {
+			x++;
+			continue;
+		}
+		start = x;
+		end = ++x;
+		while (x < g->width && x - end < VC_SPAN_GAP) {
+			if (gc[x] != chars[x] || ga[x] != attrs[x])
+				end = x + 1;
+			x++;
+		}
+		memcpy(gc + start, chars + start, end - start);
+		memcpy(ga + start, attrs + start, end - start);
+		ops->span(data, row, start, end - start, gc + start, ga + start);
+		n++;
+		x = end;
+	}
+	return n;
+}
+
+/* Returns the number of operations reported, 0 if nothing changed. */
+int vcGridDiff(vcGridPtr g, vncConsolePtr c, const vcGridOps *ops, void *data)
+{
+	const char *attrs;
+	rfbBool visible = vcCursorVisible(c);
+	int row, n = 0;
+
+	if (!g->valid) {
+		ops->resync(data, g->width, g->height);
+		/* the parser never stores NUL: every row goes out */
+		memset(g->chars, 0, g->width * g->height);
+		memset(g->attrs, 0x07, g->width * g->height);
+		g->scrollSeq = c->scrollSeq;
+		g->x = g->y = -1;
+		g->valid = TRUE;
+		n++;
+	} else
+		n += replay_scrolls(g, c, ops, data);
+
+	for (row = 0; row < g->height; row++) {
+		attrs = g->attrs + row * g->width;	/* no attributes: never differ */
+#ifdef USE_ATTRIBUTE_BUFFER
+		if (c->attributeBuffer)
+			attrs = c->attributeBuffer + row * c->width;
+#endif
+		n += diff_row(g, row, c->screenBuffer + row * c->width, attrs, ops, data);
+	}
+
+	if (g->x != c->x || g->y != c->y || g->cursorVisible != visible) {
+		g->x = c->x;
+		g->y = c->y;
+		g->cursorVisible = visible;
+		ops->cursor(data, c->x, c->y, visible);
+		n++;
+	}
+	return n;
+}
+
+struct encoder {
+	unsigned char *p, *end;
+	rfbBool overflow;
+};
+
+static unsigned char *reserve(struct encoder *e, size_t len)
+{
+	unsigned char *p = e->p;
+
+	if (e->overflow || len > (size_t)(e->end - e->p)) {
+		e->overflow = TRUE;
+		return NULL;
+	}
+	e->p += len;
+	return p;
+}
+
+static unsigned char *put16(unsigned char *p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, 2);
+	return p + 2;
+}
+
+static void enc_resync(void *data, int width, int height)
+{
+	unsigned char *p = reserve(data, 5);
+
+	if (p) {
+		*p++ = 'R';
+		p = put16(p, width);
+		put16(p, height);
+	}
+}
+
+static void enc_scroll(void *data, int top, int bottom, int lines)
+{
+	unsigned char *p = reserve(data, 7);
+
+	if (p) {
+		*p++ = 'S';
+		p = put16(p, top);
+		p = put16(p, bottom);
+		put16(p, (uint16_t)(int16_t)lines);
+	}
+}
+
+static void enc_span(void *data, int row, int col, int len,
+		     const char *chars, const char *attrs)
+{
+	unsigned char *p = reserve(data, 7 + 2 * len);
+
+	if (p) {
+		*p++ = 'T';
+		p = put16(p, row);
+		p = put16(p, col);
+		p = put16(p, len);
+		memcpy(p, chars, len);
+		memcpy(p + len, attrs, len);
+	}
+}
+
+static void enc_cursor(void *data, int x, int y, rfbBool visible)
+{
+	unsigned char *p = reserve(data, 6);
+
+	if (p) {
+		*p++ = 'C';
+		p = put16(p, x);
+		p = put16(p, y);
+		*p = visible ? 1 : 0;
+	}
+}
+
+static const vcGridOps encoder_ops = {
+	enc_resync, enc_scroll, enc_span, enc_cursor
+};
+
+/*
+ * Returns the length of the messages, 0 if nothing changed or -1 if they
+ * didn't fit; the consumer then has to be resynced.
+ */
+int vcGridEncode(vcGridPtr g, vncConsolePtr c, unsigned char *buf, size_t size)
+{
+	struct encoder e = { buf, buf + size, FALSE };
+
+	vcGridDiff(g, c, &encoder_ops, &e);
+	if (e.overflow) {
+		g->valid = FALSE;
+		return -1;
+	}
+	return e.p - buf;
+}
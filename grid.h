@@ -0,0 +1,84 @@
+/*
+ * grid.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __GRID_H__
+#define __GRID_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "console.h"
+
+/* differing cells closer than this are sent as one span */
+#define VC_SPAN_GAP	4
+
+/*
+ * What a text consumer is known to have on its screen. vcGridDiff()
+ * reports the changes from there to the console as scrolls, spans of
+ * cells and cursor moves, and brings the shadow up to date.
+ *
+ * A scroll moves rows top..bottom-1 up by lines (down if negative); the
+ * rows it uncovers are blank: ' ' with attribute 0x07.
+ *
+ * vcGridEncode() writes the same changes as messages, integers in
+ * network byte order:
+ *   'R' u16 width, u16 height            resync, screen is now blank
+ *   'S' u16 top, u16 bottom, s16 lines   scroll
+ *   'T' u16 row, u16 col, u16 len, len characters, len attributes
+ *   'C' u16 x, u16 y, u8 visible         cursor
+ */
+typedef struct vcGrid {
+	int width, height;
+	char *chars, *attrs;
+	int x, y;
+	rfbBool cursorVisible;
+	rfbBool valid;		/* FALSE: the consumer has nothing, resync */
+	unsigned long scrollSeq;	/* last console scroll applied */
+} vcGrid, *vcGridPtr;
+
+typedef struct vcGridOps {
+	void (*resync)(void *data, int width, int height);
+	void (*scroll)(void *data, int top, int bottom, int lines);
+	void (*span)(void *data, int row, int col, int len,
+		     const char *chars, const char *attrs);
+	void (*cursor)(void *data, int x, int y, rfbBool visible);
+} vcGridOps;
+
+vcGridPtr vcGridNew(vncConsolePtr c);
+void vcGridFree(vcGridPtr g);
+int vcGridDiff(vcGridPtr g, vncConsolePtr c, const vcGridOps *ops, void *data);
+
+/* the most vcGridEncode() can produce for a console of w x h cells */
+#define vcGridEncodedMax(w,h) (5 + 6 + 7 * VC_SCROLL_LOG + \
+	(h) * (7 * ((w) / (VC_SPAN_GAP + 1) + 1) + 2 * (w)))
+
+int vcGridEncode(vcGridPtr g, vncConsolePtr c, unsigned char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GRID_H__ */
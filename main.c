@@ -28,6 +28,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
 #include <ctype.h>
 #include <limits.h>
 #include <unistd.h>
@@ -44,6 +45,15 @@
 #include "console.h"
 #include "vga.h"
 #include "vt100.h"
+#include "admission.h"
+#include "client.h"
+#include "recorder.h"
+#include "shm.h"
+#include "thumbnail.h"
+#include "delta.h"
+#include "ttyq.h"
+#include "metrics.h"
+#include "probes.h"
 
 #include <vzctl/libvzctl.h>
 #include <linux/vzcalluser.h>
@@ -55,84 +65,113 @@
 #define _WITH_MUTEX_
 #define MAX_PASSWD	4096
 #define MAX_TTY		12
+#define TTY_CHUNK	4096
+#define EVENT_TIMEOUT	100000	/* usec */
+#define THREADED_TICK	20000	/* usec between housekeeping passes with --threaded */
 
 static char progname[NAME_MAX + 1];
 static char title[128];
 
 static int handle_rfb_event = 0;
 static sig_atomic_t shutting_down = 0;
+static volatile sig_atomic_t dump_profile = 0;
 
 #ifdef _WITH_MUTEX_
 static pthread_mutex_t mutex;
+
+static int lock_console(void)
+{
+	long long t = vcNow();
+	int rc = pthread_mutex_lock(&mutex);
+
+	t = vcNow() - t;
+	METRIC_INC(METRIC_MUTEX_LOCKS);
+	METRIC_ADD(METRIC_MUTEX_WAIT, t);
+	metrics_time(STAGE_MUTEX, t);
+	return rc;
+}
 #endif
 static int tty_fd = -1;
 
 static vncConsole *console = NULL;
 
-struct linuxConsoleSequence
+/* escape sequences of the keysyms 0xff00-0xffff, indexed by the low byte */
+#define KEY_SEQ(keySym, s)	[(keySym) & 0xff] = { s, sizeof(s) - 1 }
+
+static const struct linuxConsoleSequence
 {
-	rfbKeySym keySym;
-	const char * sequence;
-} linuxConsoleSequences[] = {
-{ XK_Escape, "\e" },
-{ XK_Tab, "\t" },
-{ XK_Return, "\r" },
-{ XK_BackSpace, "\177" },
-{ XK_Home, "\e[1~" },
-{ XK_KP_Home, "\e[1~" },
-{ XK_Insert, "\e[2~" },
-{ XK_KP_Insert, "\e[2~" },
-{ XK_Delete, "\e[3~" },
-{ XK_KP_Delete, "\e[3~" },
-{ XK_End, "\e[4~" },
-{ XK_KP_End, "\e[4~" },
-{ XK_Page_Up, "\e[5~" },
-{ XK_KP_Page_Up, "\e[5~" },
-{ XK_Page_Down, "\e[6~" },
-{ XK_KP_Page_Down, "\e[6~" },
-{ XK_Up, "\e[A" },
-{ XK_KP_Up, "\e[A" },
-{ XK_Down, "\e[B" },
-{ XK_KP_Down, "\e[B" },
-{ XK_Right, "\e[C" },
-{ XK_KP_Right, "\e[C" },
-{ XK_Left, "\e[D" },
-{ XK_KP_Left, "\e[D" },
-{ XK_KP_Begin, "\e[G" },
-{ XK_F1, "\e[[A" },
-{ XK_F2, "\e[[B" },
-{ XK_F3, "\e[[C" },
-{ XK_F4, "\e[[D" },
-{ XK_F5, "\e[[E" },
-{ XK_F6, "\e[17~" },
-{ XK_F7, "\e[18~" },
-{ XK_F8, "\e[19~" },
-{ XK_F9, "\e[20~" },
-{ XK_F10, "\e[21~" },
-{ XK_F11, "\e[23~" },
-{ XK_F12, "\e[24~" },
-{ XK_F13, "\e[25~" },
-{ XK_F14, "\e[26~" },
-{ XK_F15, "\e[28~" },
-{ XK_F16, "\e[29~" },
-{ XK_F17, "\e[31~" },
-{ XK_F18, "\e[32~" },
-{ XK_F19, "\e[33~" },
-{ XK_F20, "\e[34~" },
-{ 0, "" },
+	const char *sequence;
+	size_t len;
+} linuxConsoleSequences[256] = {
+KEY_SEQ(XK_Escape, "\e"),
+KEY_SEQ(XK_Tab, "\t"),
+KEY_SEQ(XK_Return, "\r"),
+KEY_SEQ(XK_BackSpace, "\177"),
+KEY_SEQ(XK_Home, "\e[1~"),
+KEY_SEQ(XK_KP_Home, "\e[1~"),
+KEY_SEQ(XK_Insert, "\e[2~"),
+KEY_SEQ(XK_KP_Insert, "\e[2~"),
+KEY_SEQ(XK_Delete, "\e[3~"),
+KEY_SEQ(XK_KP_Delete, "\e[3~"),
+KEY_SEQ(XK_End, "\e[4~"),
+KEY_SEQ(XK_KP_End, "\e[4~"),
+KEY_SEQ(XK_Page_Up, "\e[5~"),
+KEY_SEQ(XK_KP_Page_Up, "\e[5~"),
+KEY_SEQ(XK_Page_Down, "\e[6~"),
+KEY_SEQ(XK_KP_Page_Down, "\e[6~"),
+KEY_SEQ(XK_Up, "\e[A"),
+KEY_SEQ(XK_KP_Up, "\e[A"),
+KEY_SEQ(XK_Down, "\e[B"),
+KEY_SEQ(XK_KP_Down, "\e[B"),
+KEY_SEQ(XK_Right, "\e[C"),
+KEY_SEQ(XK_KP_Right, "\e[C"),
+KEY_SEQ(XK_Left, "\e[D"),
+KEY_SEQ(XK_KP_Left, "\e[D"),
+KEY_SEQ(XK_KP_Begin, "\e[G"),
+KEY_SEQ(XK_F1, "\e[[A"),
+KEY_SEQ(XK_F2, "\e[[B"),
+KEY_SEQ(XK_F3, "\e[[C"),
+KEY_SEQ(XK_F4, "\e[[D"),
+KEY_SEQ(XK_F5, "\e[[E"),
+KEY_SEQ(XK_F6, "\e[17~"),
+KEY_SEQ(XK_F7, "\e[18~"),
+KEY_SEQ(XK_F8, "\e[19~"),
+KEY_SEQ(XK_F9, "\e[20~"),
+KEY_SEQ(XK_F10, "\e[21~"),
+KEY_SEQ(XK_F11, "\e[23~"),
+KEY_SEQ(XK_F12, "\e[24~"),
+KEY_SEQ(XK_F13, "\e[25~"),
+KEY_SEQ(XK_F14, "\e[26~"),
+KEY_SEQ(XK_F15, "\e[28~"),
+KEY_SEQ(XK_F16, "\e[29~"),
+KEY_SEQ(XK_F17, "\e[31~"),
+KEY_SEQ(XK_F18, "\e[32~"),
+KEY_SEQ(XK_F19, "\e[33~"),
+KEY_SEQ(XK_F20, "\e[34~"),
 };
 
 void do_key(rfbBool down,rfbKeySym keySym,rfbClientPtr cl)
 {
 	static short isControl = 0;
+	static short isShift = 0;
 	(void)cl;
 
+	PROBE3(key, cl->sock, down, keySym);
 	if(down) {
 		if(keySym==XK_Control_L || keySym==XK_Control_R)
 			isControl = 1;
-		else if(tty_fd>=0)
+		else if(keySym==XK_Shift_L || keySym==XK_Shift_R)
+			isShift = 1;
+		else if(isShift && (keySym==XK_Page_Up || keySym==XK_KP_Page_Up))
+			vcScrollHistory(console, console->height / 2);
+		else if(isShift && (keySym==XK_Page_Down || keySym==XK_KP_Page_Down))
+			vcScrollHistory(console, -console->height / 2);
+		else
 		{
-			int i;
+			char ch;
+
+			if(console->viewOffset)
+				vcScrollHistory(console, -console->viewOffset);
 			if(isControl) {
 				if(keySym>='a' && keySym<='z')
 					keySym-='a'-1;
@@ -140,51 +179,80 @@ void do_key(rfbBool down,rfbKeySym keySym,rfbClientPtr cl)
 					keySym-='A'-1;
 				else
 					keySym=0xffff;
-			} else
-				for(i = 0; linuxConsoleSequences[i].keySym; i++)
-					if( linuxConsoleSequences[i].keySym == keySym )
-					{
-						if (write(tty_fd,
-								  linuxConsoleSequences[i].sequence,
-								  strlen(linuxConsoleSequences[i].sequence)) == -1)
-							perror("write()");
-						return;
-					}
+			} else if((keySym & ~0xffUL) == 0xff00 &&
+					linuxConsoleSequences[keySym & 0xff].sequence) {
+				ttyq_put(linuxConsoleSequences[keySym & 0xff].sequence,
+						linuxConsoleSequences[keySym & 0xff].len);
+				return;
+			}
 
 			if(keySym<0x100)
 			{
-				if (write(tty_fd, &keySym, 1) == -1)
-					perror( "write()");
+				ch = keySym;
+				ttyq_put(&ch, 1);
 			}
 		}
 	} else if(keySym==XK_Control_L || keySym==XK_Control_R)
 		isControl = 0;
+	else if(keySym==XK_Shift_L || keySym==XK_Shift_R)
+		isShift = 0;
 }
 
-time_t last_access;
+#define PASTE_START	"\e[200~"
+#define PASTE_END	"\e[201~"
+
+/* the whole clipboard in one go, instead of a key event per character */
+static void do_paste(vncConsolePtr c, const char *text, int len)
+{
+	const int n = sizeof(PASTE_END) - 1;
+	int i, from = 0;
+
+	if (c->viewOffset)
+		vcScrollHistory(c, -c->viewOffset);
+	if (!c->bracketedPaste) {
+		ttyq_put(text, len);
+		return;
+	}
+
+	ttyq_put(PASTE_START, sizeof(PASTE_START) - 1);
+	/* pasted text must not be able to end the paste early */
+	for (i = 0; i + n <= len; i++)
+		if (text[i] == '\e' && !memcmp(text + i, PASTE_END, n)) {
+			ttyq_put(text + from, i - from);
+			from = i + n;
+			i += n - 1;
+		}
+	ttyq_put(text + from, len - from);
+	ttyq_put(PASTE_END, sizeof(PASTE_END) - 1);
+}
 
 static void do_client_disconnect(rfbClientPtr cl)
 {
-	vzvnc_logger(VZ_VNC_INFO, "Client %s disconnected", cl->host);
-	last_access = time(NULL);
+	PROBE2(client_disconnect, cl->host, cl->sock);
+	admission_forget(cl);
+	vcClientGone(cl);
+	/* a held client refused by admission_poll() was never connected */
+	if (!cl->onHold)
+		vzvnc_logger(VZ_VNC_INFO, "Client %s disconnected", cl->host);
 }
 
 static enum rfbNewClientAction do_client_connect(rfbClientPtr cl)
 {
-	time_t current = time(NULL);
-	if (difftime(current, last_access) < 1.0) {
-		vzvnc_logger(VZ_VNC_INFO, "Client %s will be gently delayed",
-				cl->host);
-		/* just a little sleep to prevent possible DDoS */
-		usleep(cl->screen->deferUpdateTime ?
-			cl->screen->deferUpdateTime * 100000 : 500000);
-	}
+	enum rfbNewClientAction action = admission_check(cl);
+
+	PROBE3(client_connect, cl->host, cl->sock, action);
+	if (action == RFB_CLIENT_REFUSE)
+		return action;
 
+	if (vcClientNew(cl) == NULL) {
+		admission_forget(cl);
+		return RFB_CLIENT_REFUSE;
+	}
 	cl->clientGoneHook = do_client_disconnect;
-	vzvnc_logger(VZ_VNC_INFO, "Client %s connected", cl->host);
-	last_access = time(NULL);
+	if (action == RFB_CLIENT_ACCEPT)
+		vzvnc_logger(VZ_VNC_INFO, "Client %s connected", cl->host);
 
-	return RFB_CLIENT_ACCEPT;
+	return action;
 }
 
 
@@ -206,6 +274,7 @@ static void _shutdown()
 	if (!shutting_down) {
 		shutting_down = 1;
 		if (tty_fd != -1) {
+			ttyq_close();
 			if( !system_console )
 				ioctl(tty_fd, TIOSAK);
 			close(tty_fd);
@@ -221,20 +290,39 @@ static void sigterm_handler(int sig)
 	_shutdown();
 }
 
+/* the profile is dumped by the thread which owns the parser */
+static void sigusr2_handler(int sig)
+{
+	(void)sig;
+	dump_profile = 1;
+}
+
 static void *rfb_event_handler(void* data)
 {
 	long rc = 0;
 	vncConsolePtr console = (vncConsolePtr)data;
 
+	metrics_thread(METRICS_EVENTS);
 	while (handle_rfb_event) {
 #ifdef _WITH_MUTEX_
-		usleep(1000);
-		if (pthread_mutex_lock(&mutex)) {
+		usleep(console->threaded ? THREADED_TICK : 1000);
+		if (lock_console()) {
 			rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "pthread_mutex_lock(): %m");
 			break;
 		}
 #endif
-		rfbProcessEvents(console->screen, console->selectTimeOut);
+		/* with --threaded clients have threads of their own and
+		 * this one only keeps the rest going */
+		if (!console->threaded) {
+			/* whatever the tty didn't take is retried soon */
+			console->selectTimeOut = ttyq_pending() ? TTYQ_RETRY : EVENT_TIMEOUT;
+			vcProcessEvents(console);
+		}
+		ttyq_flush();
+		admission_poll(console->screen);
+		thumb_poll(console);
+		delta_poll(console);
+		metrics_poll(console);
 #ifdef _WITH_MUTEX_
 		pthread_mutex_unlock(&mutex);
 #endif
@@ -242,6 +330,106 @@ static void *rfb_event_handler(void* data)
 	pthread_exit((void *)rc);
 }
 
+#ifdef _WITH_MUTEX_
+/*
+ * With --threaded libvncserver reads from and encodes for every client
+ * on threads of its own, and calls the hooks from there. These take the
+ * console mutex around the hooks which were installed before, so a slow
+ * client blocks in send() only its own thread, never the tty or other
+ * viewers. The mutex is recursive: a held client refused by
+ * admission_poll() comes back here through its clientGoneHook.
+ */
+static struct {
+	rfbKbdAddEventProcPtr kbdAddEvent;
+	rfbPtrAddEventProcPtr ptrAddEvent;
+	rfbSetXCutTextProcPtr setXCutText;
+	rfbNewClientHookPtr newClientHook;
+	rfbDisplayHookPtr displayHook;
+	rfbDisplayFinishedHookPtr displayFinishedHook;
+	ClientGoneHookPtr clientGoneHook;
+} unlocked;
+
+static void locked_key(rfbBool down, rfbKeySym keySym, rfbClientPtr cl)
+{
+	lock_console();
+	unlocked.kbdAddEvent(down, keySym, cl);
+	ttyq_flush();
+	pthread_mutex_unlock(&mutex);
+}
+
+static void locked_ptr(int buttonMask, int x, int y, rfbClientPtr cl)
+{
+	lock_console();
+	unlocked.ptrAddEvent(buttonMask, x, y, cl);
+	ttyq_flush();
+	pthread_mutex_unlock(&mutex);
+}
+
+static void locked_cut_text(char *str, int len, rfbClientPtr cl)
+{
+	lock_console();
+	unlocked.setXCutText(str, len, cl);
+	pthread_mutex_unlock(&mutex);
+}
+
+static void locked_display(rfbClientPtr cl)
+{
+	lock_console();
+	unlocked.displayHook(cl);
+	pthread_mutex_unlock(&mutex);
+}
+
+static void locked_display_finished(rfbClientPtr cl, int result)
+{
+	lock_console();
+	unlocked.displayFinishedHook(cl, result);
+	pthread_mutex_unlock(&mutex);
+}
+
+static void locked_client_gone(rfbClientPtr cl)
+{
+	lock_console();
+	unlocked.clientGoneHook(cl);
+	pthread_mutex_unlock(&mutex);
+}
+
+static enum rfbNewClientAction locked_client_connect(rfbClientPtr cl)
+{
+	enum rfbNewClientAction action;
+
+	lock_console();
+	action = unlocked.newClientHook(cl);
+	if (action != RFB_CLIENT_REFUSE && cl->clientGoneHook) {
+		unlocked.clientGoneHook = cl->clientGoneHook;
+		cl->clientGoneHook = locked_client_gone;
+	}
+	pthread_mutex_unlock(&mutex);
+	return action;
+}
+
+static void run_threaded(vncConsolePtr c)
+{
+	rfbScreenInfoPtr s = c->screen;
+
+	unlocked.kbdAddEvent = s->kbdAddEvent;
+	unlocked.ptrAddEvent = s->ptrAddEvent;
+	unlocked.setXCutText = s->setXCutText;
+	unlocked.newClientHook = s->newClientHook;
+	unlocked.displayHook = s->displayHook;
+	unlocked.displayFinishedHook = s->displayFinishedHook;
+	s->kbdAddEvent = locked_key;
+	s->ptrAddEvent = locked_ptr;
+	s->setXCutText = locked_cut_text;
+	s->newClientHook = locked_client_connect;
+	s->displayHook = locked_display;
+	s->displayFinishedHook = locked_display_finished;
+	/* libvncserver waits this long (msec) for more damage */
+	s->deferUpdateTime = c->deferUpdateTime / 1000;
+	c->threaded = TRUE;
+	rfbRunEventLoop(s, -1, TRUE);
+}
+#endif
+
 static void usage(int code)
 {
 	fprintf(stderr, PRODUCT_NAME_SHORT " VNC server for Containers\n");
@@ -264,6 +452,31 @@ static void usage(int code)
 	fprintf(stderr,"    -v/--verbose        set verbose level for stdout/stderr\n");
 	fprintf(stderr,"    -c/--sslcert CFILE  specify SSL certificate file for websockets\n");
 	fprintf(stderr,"    -s/--system         use tty1 (aka /dev/console) to connect with\n");
+	fprintf(stderr,"       --truecolour     use 32bpp true colour framebuffer instead of 8bpp\n");
+	fprintf(stderr,"                        colour map (no per-client translation for most viewers)\n");
+	fprintf(stderr,"       --scrollback KB  memory for compressed scrollback history, viewed with\n");
+	fprintf(stderr,"                        Shift+PgUp/PgDn (%d by default, 0 disables)\n", SB_DEFAULT_SIZE / 1024);
+	fprintf(stderr,"       --font FILE      PSF2 console font for the characters CP437 doesn't have\n");
+	fprintf(stderr,"       --cp437          take console output as CP437 bytes instead of UTF-8\n");
+	fprintf(stderr,"       --record FILE    record console output with timestamps into FILE and\n");
+	fprintf(stderr,"                        its keyframe index into FILE.idx (neither may exist)\n");
+	fprintf(stderr,"       --record-keyframe SEC\n");
+	fprintf(stderr,"                        seconds between two recording keyframes (%d by default)\n", REC_KEYFRAME_INTERVAL);
+	fprintf(stderr,"       --shm            export the text screen to /dev/shm" VZVNC_SHM_PREFIX "CTID-ttyN\n");
+	fprintf(stderr,"       --thumbnail PATH serve PNG thumbnails of the screen on Unix socket PATH\n");
+	fprintf(stderr,"       --delta PATH     stream text screen changes on Unix socket PATH\n");
+	fprintf(stderr,"       --profile-escapes count and time escape sequences by final byte,\n");
+	fprintf(stderr,"                        logged on SIGUSR2 and on exit\n");
+	fprintf(stderr,"       --metrics PATH   serve counters in Prometheus text format on Unix socket PATH\n");
+	fprintf(stderr,"       --client-cursor  let viewers draw the text cursor from a cursor shape\n");
+	fprintf(stderr,"                        and position updates (not with --threaded)\n");
+	fprintf(stderr,"       --threaded       serve every client from threads of its own, so a slow\n");
+	fprintf(stderr,"                        one can't hold up others (no per-client update policy,\n");
+	fprintf(stderr,"                        shared updates or text grid encoding)\n");
+	fprintf(stderr,"       --tty-overflow drop|wait\n");
+	fprintf(stderr,"                        what to do with input when the tty doesn't take it\n");
+	fprintf(stderr,"                        and its queue is full: drop it (default) or stall\n");
+	fprintf(stderr,"                        all viewers for up to %d ms waiting for the tty\n", TTYQ_WAIT_MAX);
 	fprintf(stderr,"    -k/--sslkey KFILE   specify SSL key file for websockets\n");
 	fprintf(stderr,"    -h/--help           show usage and exit\n");
 	exit(code);
@@ -284,6 +497,20 @@ struct options {
 	int ws_send_timeout;
 	char *portv6;
 	char *addrv6;
+	int truecolour;
+	long scrollback;
+	char *record;
+	int record_keyframe;
+	int shm;
+	char *thumbnail;
+	char *delta;
+	enum ttyq_policy tty_overflow;
+	int threaded;
+	char *metrics;
+	int profile_escapes;
+	char *font;
+	int cp437;
+	int client_cursor;
 };
 
 static int parse_cmd_line(int argc, char *argv[], struct options *opts)
@@ -296,6 +523,20 @@ static int parse_cmd_line(int argc, char *argv[], struct options *opts)
 		{"listenv6", required_argument, NULL, 7},
 		{"port", required_argument, NULL, 'p'},
 		{"portv6", required_argument, NULL, 8},
+		{"truecolour", no_argument, NULL, 9},
+		{"scrollback", required_argument, NULL, 10},
+		{"record", required_argument, NULL, 11},
+		{"record-keyframe", required_argument, NULL, 12},
+		{"shm", no_argument, NULL, 13},
+		{"thumbnail", required_argument, NULL, 14},
+		{"delta", required_argument, NULL, 15},
+		{"tty-overflow", required_argument, NULL, 16},
+		{"threaded", no_argument, NULL, 17},
+		{"metrics", required_argument, NULL, 18},
+		{"profile-escapes", no_argument, NULL, 19},
+		{"font", required_argument, NULL, 20},
+		{"cp437", no_argument, NULL, 21},
+		{"client-cursor", no_argument, NULL, 22},
 		{"auto-port", no_argument, NULL, 1},
 		{"min-port", required_argument, NULL, 2},
 		{"max-port", required_argument, NULL, 3},
@@ -313,6 +554,7 @@ static int parse_cmd_line(int argc, char *argv[], struct options *opts)
 	struct vzctl_config * cfg = vzctl2_conf_open(VZ_GLOBAL_CFG, VZCTL_CONF_SKIP_GLOBAL, &err);
 
 	memset((void *)opts, 0, sizeof(struct options));
+	opts->scrollback = SB_DEFAULT_SIZE / 1024;
 
 	if (cfg)
 	{
@@ -416,6 +658,78 @@ static int parse_cmd_line(int argc, char *argv[], struct options *opts)
 				usage(VZ_VNC_ERR_PARAM);
 			opts->portv6 = optarg;
 			break;
+		case 9:
+			opts->truecolour = 1;
+			break;
+		case 10:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->scrollback = strtol(optarg, &p, 10);
+			if (*p != '\0' || opts->scrollback < 0)
+				usage(VZ_VNC_ERR_PARAM);
+			break;
+		case 11:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->record = optarg;
+			break;
+		case 12:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->record_keyframe = strtol(optarg, &p, 10);
+			if (*p != '\0' || opts->record_keyframe <= 0)
+				usage(VZ_VNC_ERR_PARAM);
+			break;
+		case 13:
+			opts->shm = 1;
+			break;
+		case 14:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->thumbnail = optarg;
+			break;
+		case 15:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->delta = optarg;
+			break;
+		case 16:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			if (!strcmp(optarg, "drop"))
+				opts->tty_overflow = TTYQ_DROP;
+			else if (!strcmp(optarg, "wait"))
+				opts->tty_overflow = TTYQ_WAIT;
+			else
+				usage(VZ_VNC_ERR_PARAM);
+			break;
+		case 17:
+#if defined(_WITH_MUTEX_) && defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+			opts->threaded = 1;
+#else
+			vzvnc_error(VZ_VNC_ERR_PARAM, "--threaded is not supported by this build");
+			usage(VZ_VNC_ERR_PARAM);
+#endif
+			break;
+		case 18:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->metrics = optarg;
+			break;
+		case 19:
+			opts->profile_escapes = 1;
+			break;
+		case 20:
+			if (optarg == NULL)
+				usage(VZ_VNC_ERR_PARAM);
+			opts->font = optarg;
+			break;
+		case 21:
+			opts->cp437 = 1;
+			break;
+		case 22:
+			opts->client_cursor = 1;
+			break;
 		case 'h':
 			usage(VZ_VNC_ERR_PARAM);
 			exit(0);
@@ -424,6 +738,11 @@ static int parse_cmd_line(int argc, char *argv[], struct options *opts)
 			exit(1);
 		}
 	}
+	/* client threads are not woken up by the cursor moving */
+	if (opts->client_cursor && opts->threaded) {
+		vzvnc_error(VZ_VNC_ERR_PARAM, "--client-cursor can't be used with --threaded");
+		usage(VZ_VNC_ERR_PARAM);
+	}
 	return 0;
 }
 
@@ -432,7 +751,7 @@ int main(int argc,char **argv)
 	int rc = 0;
 
 	int width = 80, height = 24;
-	char buf;
+	char buf[TTY_CHUNK];
 	int i;
 
 	const char *vzctl = "/dev/vzctl";
@@ -445,7 +764,11 @@ int main(int argc,char **argv)
 	struct vzctl_env_handle *h = NULL;
 	ctid_t ctid = {};
 	ssize_t sz;
+	long long parse_start;
 	pthread_t thread;
+#ifdef _WITH_MUTEX_
+	pthread_mutexattr_t mutex_attr;
+#endif
 	int rfbArgc = 5;
 	// default VNS addr & port
 	char *rfbArgv[15] = {argv[0], (char *)"-listen", (char *)"0.0.0.0", (char *)"-listenv6", (char *)"::", NULL};
@@ -490,12 +813,16 @@ int main(int argc,char **argv)
 		usage(rc);
 	}
 
+	metrics_thread(METRICS_READER);
 	signal(SIGINT, sigterm_handler);
 	signal(SIGTERM, sigterm_handler);
 
 #ifdef _WITH_MUTEX_
-	if (pthread_mutex_init(&mutex, NULL))
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&mutex, &mutex_attr))
 		return vzvnc_error(VZ_VNC_ERR_SYSTEM, "pthread_mutex_init(): %m");
+	pthread_mutexattr_destroy(&mutex_attr);
 #endif
 
 	dev = open(vzctl, O_RDONLY);
@@ -534,6 +861,7 @@ int main(int argc,char **argv)
 		rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "All %d tty devices are busy in CT %s. Exiting...", MAX_TTY, ctid);
 		goto cleanup_0;
 	}
+	ttyq_init(tty_fd, opts.tty_overflow);
 
 	if (c.val > 1)
 	{
@@ -607,7 +935,8 @@ int main(int argc,char **argv)
 		rfbArgv[rfbArgc] = NULL;
 	}
 
-	if ((console = vcGetConsole(&rfbArgc, rfbArgv, width, height, &vgaFont
+	if ((console = vcGetConsole(&rfbArgc, rfbArgv, width, height, &vgaFont,
+			opts.truecolour
 #ifdef USE_ATTRIBUTE_BUFFER
 		,TRUE
 #endif
@@ -616,6 +945,19 @@ int main(int argc,char **argv)
 		goto cleanup_0;
 	}
 
+	if (opts.scrollback)
+		vcEnableScrollback(console, opts.scrollback * 1024);
+
+	if (opts.font && vcLoadFont(console, opts.font)) {
+		rc = vzvnc_error(VZ_VNC_ERR_PARAM, "Can't use font %s", opts.font);
+		goto cleanup_0;
+	}
+
+	if (opts.client_cursor && vcEnableClientCursor(console)) {
+		rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "Can't enable the client cursor");
+		goto cleanup_0;
+	}
+
 	if (opts.auto_port) {
 		console->screen->autoPort = TRUE;
 		if (opts.min_port)
@@ -659,18 +1001,31 @@ int main(int argc,char **argv)
 		goto cleanup_0;
 	}
 
-	for (i=0;i<16;i++) {
-		console->screen->colourMap.data.bytes[i*3+0]=default_red[color_table[i]];
-		console->screen->colourMap.data.bytes[i*3+1]=default_grn[color_table[i]];
-		console->screen->colourMap.data.bytes[i*3+2]=default_blu[color_table[i]];
-	}
+	for (i=0;i<16;i++)
+		vcSetColour(console, i, default_red[color_table[i]],
+			default_grn[color_table[i]], default_blu[color_table[i]]);
 	console->screen->desktopName = title;
 	console->screen->kbdAddEvent = do_key;
+	console->pasteHook = do_paste;
 	console->screen->newClientHook = do_client_connect;
-	console->selectTimeOut = 100000;
+	console->selectTimeOut = EVENT_TIMEOUT;
 	console->wrapBottomToTop = FALSE;
 	console->cursorActive = TRUE;
 
+	if (opts.thumbnail && (rc = thumb_open(opts.thumbnail)))
+		goto cleanup_0;
+
+	if (opts.delta && (rc = delta_open(opts.delta)))
+		goto cleanup_0;
+
+	if (opts.metrics && (rc = metrics_open(opts.metrics)))
+		goto cleanup_0;
+
+#ifdef _WITH_MUTEX_
+	if (opts.threaded)
+		run_threaded(console);
+#endif
+
 	handle_rfb_event = 1;
 	if (pthread_create(&thread, NULL, rfb_event_handler, (void *)console) < 0) {
 		rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "phtread_create(): %m");
@@ -679,30 +1034,86 @@ int main(int argc,char **argv)
 
 	vcHideCursor(console);
 	vt_init(console);
+	if (opts.cp437)
+		vt_set_utf8(FALSE);
+
+	if (opts.record && (rc = recorder_open(opts.record, opts.record_keyframe, console)))
+		goto cleanup_1;
+
+	if (opts.shm) {
+		snprintf(name, sizeof(name), "%s-tty%d", ctid, c.val + 1);
+		if ((rc = shm_export_open(name, console)))
+			goto cleanup_1;
+	}
+
+	if (opts.profile_escapes) {
+		if ((rc = vt_profile_start()))
+			goto cleanup_1;
+		signal(SIGUSR2, sigusr2_handler);
+	}
 
 	while (rfbIsActive(console->screen) && !shutting_down) {
-		sz = read(tty_fd, &buf, sizeof(buf));
+		if (dump_profile) {
+			dump_profile = 0;
+			vt_profile_dump();
+		}
+		/* whatever the tty has, so a burst of output is parsed under
+		 * one lock and recorded as one chunk */
+		struct pollfd pfd = { tty_fd, POLLIN, 0 };
+		int ready;
+
+		/* the tty is non-blocking for the sake of ttyq; wake up now
+		 * and then to notice a shutdown */
+		ready = poll(&pfd, 1, 1000);
+		if (ready == 0 || (ready < 0 && errno == EINTR))
+			continue;
+		if (ready < 0) {
+			rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "poll(): %m");
+			goto cleanup_1;
+		}
+		sz = read(tty_fd, buf, sizeof(buf));
+		METRIC_INC(METRIC_TTY_READS);
+		if (sz == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
 		if (sz == -1) {
 			rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "read(): %m");
 			goto cleanup_1;
 		}
+		METRIC_ADD(METRIC_TTY_BYTES, sz);
+		PROBE1(tty_read, sz);
+		/* no lock needed: only this thread changes the text buffers */
+		recorder_write(console, buf, sz);
 #ifdef _WITH_MUTEX_
 		// lock mutex
-		if (pthread_mutex_lock(&mutex)) {
+		if (lock_console()) {
 			rc = vzvnc_error(VZ_VNC_ERR_SYSTEM, "pthread_mutex_lock(): %m");
 			goto cleanup_1;
 		}
 #endif
-		vt_out(console, buf);
+		parse_start = vcNow();
+		for (i = 0; i < sz; i++)
+			vt_out(console, buf[i]);
+		/* client threads only wake up for damage: a cursor that just
+		 * moved has to be in the frame by the time they do */
+		if (console->threaded)
+			vcFlushCursor(console);
+		metrics_time(STAGE_PARSE, vcNow() - parse_start);
+		shm_export_update(console);
 #ifdef _WITH_MUTEX_
 		pthread_mutex_unlock(&mutex);
 #endif
 	}
 
 cleanup_1:
+	vt_profile_dump();
+	recorder_close();
+	shm_export_close();
 	handle_rfb_event = 0;
 	pthread_join(thread, NULL);
 cleanup_0:
+	thumb_close();
+	delta_close();
+	metrics_close();
 	if (console != NULL)
 		rfbShutdownServer(console->screen, 1);
 #ifdef _WITH_MUTEX_
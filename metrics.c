@@ -0,0 +1,380 @@
+/*
+ * metrics.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Prometheus text exposition on a Unix socket: every connection gets an
+ * HTTP/1.0 response with the current values and is closed, so both
+ * "curl --unix-socket" and a scraper behind a socket proxy can read it.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <rfb/rfb.h>
+#include "util.h"
+#include "client.h"
+#include "metrics.h"
+
+#define METRICS_BUF	65536
+/* how much of a request is read and for how long it is waited for (usec) */
+#define METRICS_REQUEST	4096
+#define METRICS_REQUEST_WAIT	1000000
+/* connections whose request is still coming in */
+#define METRICS_PENDING	8
+
+static struct metrics_slot slots[METRICS_THREADS];
+__thread struct metrics_slot *metrics_self = &slots[METRICS_OTHER];
+
+static const struct {
+	const char *name;
+	const char *help;
+	double scale;	/* to the unit in the name, 0 if none */
+} info[METRIC_COUNT] = {
+	[METRIC_TTY_READS] = { "tty_reads_total", "read() calls on the tty" },
+	[METRIC_TTY_BYTES] = { "tty_read_bytes_total", "Console output read from the tty" },
+	[METRIC_ESCAPES] = { "escape_sequences_total", "Escape sequences parsed" },
+	[METRIC_GLYPHS] = { "glyphs_drawn_total", "Character cells drawn into the framebuffer" },
+	[METRIC_GLYPH_CACHE_MISSES] = { "glyph_cache_misses_total", "Font glyphs rendered into the glyph cache" },
+	[METRIC_SCROLLS] = { "scrolls_total", "Scrolls, line inserts and deletes" },
+	[METRIC_DAMAGE_RECTS] = { "damage_rects_total", "Framebuffer rectangles marked as modified" },
+	[METRIC_DAMAGE_PIXELS] = { "damage_pixels_total", "Pixels in those rectangles" },
+	[METRIC_UPDATES] = { "updates_sent_total", "Framebuffer updates sent" },
+	[METRIC_UPDATES_HELD] = { "updates_held_total", "Updates held back for a client with a full socket" },
+	[METRIC_CLIENTS] = { "clients_connected_total", "Clients connected" },
+	[METRIC_CLIENTS_GONE] = { "clients_disconnected_total", "Clients disconnected" },
+	[METRIC_CONNECTS_ACCEPTED] = { "connects_accepted_total", "Connections admitted" },
+	[METRIC_CONNECTS_DEFERRED] = { "connects_deferred_total", "Connections put on hold by admission control" },
+	[METRIC_CONNECTS_REJECTED] = { "connects_rejected_total", "Connections refused by admission control" },
+	[METRIC_MUTEX_LOCKS] = { "mutex_locks_total", "Console mutex acquisitions" },
+	[METRIC_MUTEX_WAIT] = { "mutex_wait_seconds_total", "Time spent waiting for the console mutex", 1e-6 },
+	[METRIC_TTY_BACKPRESSURE] = { "tty_backpressure_total", "Times the tty did not take all queued input" },
+	[METRIC_TTY_OVERFLOWS] = { "tty_overflows_total", "Input dropped for a full tty queue" },
+	[METRIC_TTY_DROPPED] = { "tty_dropped_bytes_total", "Bytes of input dropped" },
+};
+
+static const char *stage_name[STAGE_COUNT] = {
+	[STAGE_MUTEX] = "mutex",
+	[STAGE_PARSE] = "parse",
+	[STAGE_QUEUE] = "queue",
+	[STAGE_SEND] = "send",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NQUANTILES	(int)(sizeof(quantiles) / sizeof(quantiles[0]))
+
+/* bytes sent per encoding, counted with the console locked */
+static struct {
+	int encoding;
+	unsigned long long updates, bytes;
+} encodings[16];
+static int nencodings;
+
+static int metrics_fd = -1;
+static char metrics_path[PATH_MAX];
+static char buf[METRICS_BUF];
+static size_t len;
+
+/* nothing here waits for a reader: its request is picked up piece by
+ * piece on the event loop passes and answered once it is complete */
+static struct pending {
+	int fd;
+	long long since;
+	size_t got;
+	char req[METRICS_REQUEST];
+} pending[METRICS_PENDING];
+static int npending;
+
+void metrics_thread(enum metrics_thread t)
+{
+	metrics_self = &slots[t];
+}
+
+unsigned long long metrics_get(enum metric m)
+{
+	unsigned long long sum = 0;
+	int i;
+
+	for (i = 0; i < METRICS_THREADS; i++)
+		sum += slots[i].c[m];
+	return sum;
+}
+
+void metrics_encoding(int encoding, unsigned long bytes)
+{
+	int i;
+
+	for (i = 0; i < nencodings; i++)
+		if (encodings[i].encoding == encoding)
+			break;
+	if (i == nencodings) {
+		if (nencodings == (int)(sizeof(encodings) / sizeof(encodings[0])))
+			return;
+		encodings[nencodings++].encoding = encoding;
+	}
+	encodings[i].updates++;
+	encodings[i].bytes += bytes;
+}
+
+int metrics_open(const char *path)
+{
+	if ((metrics_fd = listen_unix(path)) < 0)
+		return VZ_VNC_ERR_SOCK;
+	snprintf(metrics_path, sizeof(metrics_path), "%s", path);
+	vzvnc_logger(VZ_VNC_INFO, "Metrics served on %s", path);
+	return 0;
+}
+
+void metrics_close(void)
+{
+	while (npending > 0)
+		close(pending[--npending].fd);
+	if (metrics_fd >= 0) {
+		close(metrics_fd);
+		unlink(metrics_path);
+	}
+	metrics_fd = -1;
+}
+
+static void out(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		len += (size_t)n < sizeof(buf) - len ? (size_t)n : sizeof(buf) - len - 1;
+}
+
+static void header(const char *name, const char *type, const char *help)
+{
+	out("# HELP vzvnc_%s %s\n# TYPE vzvnc_%s %s\n", name, help, name, type);
+}
+
+static long resident_bytes(void)
+{
+	FILE *fp = fopen("/proc/self/statm", "r");
+	long size, resident = 0;
+
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* exclusive upper bound of a histogram bucket, usec */
+static unsigned long long bucket_limit(int i)
+{
+	int e;
+
+	if (i < (1 << METRICS_HIST_SUB))
+		return i + 1;
+	e = (i >> METRICS_HIST_SUB) + METRICS_HIST_SUB - 1;
+	return (unsigned long long)((1 << METRICS_HIST_SUB) + (i & ((1 << METRICS_HIST_SUB) - 1)) + 1)
+		<< (e - METRICS_HIST_SUB);
+}
+
+/*
+ * Prometheus gets the histograms at powers of two, which are bucket
+ * boundaries; the quantiles are taken from the fine buckets.
+ */
+static void render_stages(void)
+{
+	unsigned long long hist[METRICS_HIST_BUCKETS], sum, count, total;
+	unsigned long long quantile[STAGE_COUNT][NQUANTILES];
+	int s, t, i, q, power;
+
+	header("stage_latency_seconds", "histogram", "Time spent in the stages from a tty read to the socket");
+	for (s = 0; s < STAGE_COUNT; s++) {
+		memset(hist, 0, sizeof(hist));
+		sum = 0;
+		for (t = 0; t < METRICS_THREADS; t++) {
+			for (i = 0; i < METRICS_HIST_BUCKETS; i++)
+				hist[i] += slots[t].hist[s][i];
+			sum += slots[t].hist_sum[s];
+		}
+		count = 0;
+		power = 0;
+		for (i = 0; i < METRICS_HIST_FINITE; i++) {
+			count += hist[i];
+			if (bucket_limit(i) == 1ULL << power) {
+				out("vzvnc_stage_latency_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %llu\n",
+					stage_name[s], (1ULL << power) / 1e6, count);
+				power++;
+			}
+		}
+		count += hist[METRICS_HIST_FINITE];
+		out("vzvnc_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+			stage_name[s], count);
+		out("vzvnc_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n", stage_name[s], sum / 1e6);
+		out("vzvnc_stage_latency_seconds_count{stage=\"%s\"} %llu\n", stage_name[s], count);
+
+		for (q = 0; q < NQUANTILES; q++) {
+			total = 0;
+			for (i = 0; i < METRICS_HIST_FINITE; i++) {
+				total += hist[i];
+				if (total >= count * quantiles[q])
+					break;
+			}
+			/* in the overflow bucket: no upper bound to give */
+			quantile[s][q] = !count ? 0 :
+				i < METRICS_HIST_FINITE ? bucket_limit(i) : ULLONG_MAX;
+		}
+	}
+
+	header("stage_latency_quantile_seconds", "gauge", "Upper bound of the stage latency quantile since start");
+	for (s = 0; s < STAGE_COUNT; s++)
+		for (q = 0; q < NQUANTILES; q++)
+			if (quantile[s][q] == ULLONG_MAX)
+				out("vzvnc_stage_latency_quantile_seconds{stage=\"%s\",quantile=\"%g\"} +Inf\n",
+					stage_name[s], quantiles[q]);
+			else
+				out("vzvnc_stage_latency_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+					stage_name[s], quantiles[q], quantile[s][q] / 1e6);
+}
+
+static void render(vncConsolePtr c)
+{
+	rfbClientIteratorPtr i;
+	rfbClientPtr cl;
+	vncClientPtr vc;
+	long lag = 0;
+	int m;
+
+	len = 0;
+	out("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+	for (m = 0; m < METRIC_COUNT; m++) {
+		header(info[m].name, "counter", info[m].help);
+		if (info[m].scale)
+			out("vzvnc_%s %.6f\n", info[m].name, metrics_get(m) * info[m].scale);
+		else
+			out("vzvnc_%s %llu\n", info[m].name, metrics_get(m));
+	}
+
+	header("encoding_updates_total", "counter", "Framebuffer updates sent per encoding");
+	for (m = 0; m < nencodings; m++)
+		out("vzvnc_encoding_updates_total{encoding=\"%s\"} %llu\n",
+			vcEncodingName(encodings[m].encoding), encodings[m].updates);
+	header("encoding_sent_bytes_total", "counter", "Bytes sent per encoding");
+	for (m = 0; m < nencodings; m++)
+		out("vzvnc_encoding_sent_bytes_total{encoding=\"%s\"} %llu\n",
+			vcEncodingName(encodings[m].encoding), encodings[m].bytes);
+
+	i = rfbGetClientIterator(c->screen);
+	while ((cl = rfbClientIteratorNext(i)))
+		if ((vc = (vncClientPtr)cl->clientData) && vc->lag > lag)
+			lag = vc->lag;
+	rfbReleaseClientIterator(i);
+
+	render_stages();
+
+	header("clients", "gauge", "Clients connected now");
+	out("vzvnc_clients %llu\n", metrics_get(METRIC_CLIENTS) - metrics_get(METRIC_CLIENTS_GONE));
+	header("client_lag_max_seconds", "gauge", "Worst smoothed time from damage to delivery over the connected clients");
+	out("vzvnc_client_lag_max_seconds %.6f\n", lag / 1e6);
+	header("client_lag_seconds", "gauge", "Smoothed time from damage to delivery per connected client");
+	i = rfbGetClientIterator(c->screen);
+	while ((cl = rfbClientIteratorNext(i)))
+		if ((vc = (vncClientPtr)cl->clientData))
+			out("vzvnc_client_lag_seconds{client=\"%s:%d\"} %.6f\n",
+				cl->host ? cl->host : "unknown", cl->sock, vc->lag / 1e6);
+	rfbReleaseClientIterator(i);
+	header("resident_memory_bytes", "gauge", "Resident set size");
+	out("vzvnc_resident_memory_bytes %ld\n", resident_bytes());
+}
+
+/*
+ * Read what has arrived of the request. Done with the blank line that
+ * ends its header, at EOF or once the buffer is full: closing a Unix
+ * socket with unread data resets the connection, and the reader gets an
+ * error after the response.
+ */
+static int read_request(struct pending *p)
+{
+	ssize_t n;
+
+	while (p->got < sizeof(p->req) - 1) {
+		n = recv(p->fd, p->req + p->got, sizeof(p->req) - 1 - p->got,
+				MSG_DONTWAIT);
+		if (n == 0)
+			return 1;
+		if (n < 0)
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		p->got += n;
+		p->req[p->got] = 0;
+		if (strstr(p->req, "\r\n\r\n") || strstr(p->req, "\n\n"))
+			return 1;
+	}
+	return 1;
+}
+
+static void reply(vncConsolePtr c, int fd)
+{
+	render(c);
+	/* a few KB, fits into the socket buffer: never wait for the reader */
+	if (send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len)
+		vzvnc_logger(VZ_VNC_DEBUG, "Metrics not sent: %m");
+	/* whatever else the reader sent must not turn close() into a reset */
+	shutdown(fd, SHUT_WR);
+	while (recv(fd, buf, METRICS_BUF, MSG_DONTWAIT) > 0)
+		;
+	close(fd);
+}
+
+/* Called from the event loop with the console locked: never blocks. */
+void metrics_poll(vncConsolePtr c)
+{
+	long long now;
+	int fd, i;
+
+	if (metrics_fd < 0)
+		return;
+
+	now = vcNow();
+	while (npending < METRICS_PENDING &&
+	       (fd = accept(metrics_fd, NULL, NULL)) >= 0) {
+		pending[npending].fd = fd;
+		pending[npending].since = now;
+		pending[npending].got = 0;
+		npending++;
+	}
+	for (i = 0; i < npending; ) {
+		if (read_request(&pending[i]) ||
+		    now - pending[i].since > METRICS_REQUEST_WAIT) {
+			reply(c, pending[i].fd);
+			pending[i] = pending[--npending];
+		} else {
+			i++;
+		}
+	}
+}
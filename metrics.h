@@ -0,0 +1,143 @@
+/*
+ * metrics.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "console.h"
+
+/*
+ * Counters for the metrics endpoint. Every thread adds to a slot of its
+ * own, cache line aligned, so a counter on a hot path is a plain
+ * increment: no atomics and no cache line bouncing between the tty
+ * reader and the event thread. The slots are summed when scraped.
+ * Threads other than those two share a slot and only count with the
+ * console locked.
+ */
+
+#define METRICS_CACHE_LINE	64
+
+enum metric {
+	METRIC_TTY_READS,
+	METRIC_TTY_BYTES,
+	METRIC_ESCAPES,
+	METRIC_GLYPHS,
+	METRIC_GLYPH_CACHE_MISSES,
+	METRIC_SCROLLS,
+	METRIC_DAMAGE_RECTS,
+	METRIC_DAMAGE_PIXELS,
+	METRIC_UPDATES,
+	METRIC_UPDATES_HELD,
+	METRIC_CLIENTS,
+	METRIC_CLIENTS_GONE,
+	METRIC_CONNECTS_ACCEPTED,
+	METRIC_CONNECTS_DEFERRED,
+	METRIC_CONNECTS_REJECTED,
+	METRIC_MUTEX_LOCKS,
+	METRIC_MUTEX_WAIT,	/* usec */
+	METRIC_TTY_BACKPRESSURE,
+	METRIC_TTY_OVERFLOWS,
+	METRIC_TTY_DROPPED,
+	METRIC_COUNT
+};
+
+/*
+ * Latency of the stages between a tty read and the socket, in log-linear
+ * histograms: 8 linear buckets per power of two of usec, so any value is
+ * within 12.5% of its bucket, from 1 usec to over a minute. Parsing and
+ * drawing are interleaved byte by byte, and so are encoding and sending
+ * in libvncserver, so each pair is one stage.
+ */
+enum stage {
+	STAGE_MUTEX,	/* waiting for the console mutex */
+	STAGE_PARSE,	/* vt_out() of a chunk read from the tty: parse and draw */
+	STAGE_QUEUE,	/* first damage to update start: coalescing, waiting
+			 * for a request or for the client's socket to drain */
+	STAGE_SEND,	/* encoding and writing an update */
+	STAGE_COUNT
+};
+
+#define METRICS_HIST_SUB	3	/* log2 of linear buckets per power of two */
+#define METRICS_HIST_MAX	26	/* values up to 2^(MAX+1) usec are bucketed */
+#define METRICS_HIST_FINITE	((METRICS_HIST_MAX - METRICS_HIST_SUB + 2) << METRICS_HIST_SUB)
+/* plus one for everything longer, only counted under le="+Inf" */
+#define METRICS_HIST_BUCKETS	(METRICS_HIST_FINITE + 1)
+
+enum metrics_thread {
+	METRICS_READER,
+	METRICS_EVENTS,
+	METRICS_OTHER,
+	METRICS_THREADS
+};
+
+struct metrics_slot {
+	unsigned long long c[METRIC_COUNT];
+	unsigned long long hist[STAGE_COUNT][METRICS_HIST_BUCKETS];
+	unsigned long long hist_sum[STAGE_COUNT];	/* usec */
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+extern __thread struct metrics_slot *metrics_self;
+
+#define METRIC_ADD(m, n)	(metrics_self->c[m] += (n))
+#define METRIC_INC(m)		METRIC_ADD(m, 1)
+
+static inline int metrics_bucket(unsigned long long usec)
+{
+	int e;
+
+	if (usec < (1 << METRICS_HIST_SUB))
+		return usec;
+	e = 63 - __builtin_clzll(usec);
+	if (e > METRICS_HIST_MAX)
+		return METRICS_HIST_FINITE;
+	return ((e - METRICS_HIST_SUB + 1) << METRICS_HIST_SUB) +
+		((usec >> (e - METRICS_HIST_SUB)) & ((1 << METRICS_HIST_SUB) - 1));
+}
+
+static inline void metrics_time(enum stage s, long long usec)
+{
+	if (usec < 0)
+		usec = 0;
+	metrics_self->hist[s][metrics_bucket(usec)]++;
+	metrics_self->hist_sum[s] += usec;
+}
+
+void metrics_thread(enum metrics_thread t);
+unsigned long long metrics_get(enum metric m);
+void metrics_encoding(int encoding, unsigned long bytes);
+
+int metrics_open(const char *path);
+void metrics_poll(vncConsolePtr console);
+void metrics_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,60 @@
+/*
+ * probes.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * USDT probes, provider "vzvnc". Each one is a NOP in the code and a
+ * note in the ELF file, until a tracer attaches to it: see
+ * contrib/bpftrace for examples. Built without <sys/sdt.h> they are
+ * nothing at all.
+ *
+ *   tty_read(bytes)				chunk of console output read
+ *   escape(state, final)			escape sequence executed
+ *   scroll(top, bottom, lines)			region scrolled (lines < 0: down)
+ *   damage(x1, y1, x2, y2)			framebuffer rectangle modified
+ *   key(sock, down, keysym)			key event from a viewer
+ *   client_connect(host, sock, action)		rfbNewClientAction
+ *   client_disconnect(host, sock)
+ *   update_start(sock)
+ *   update_sent(sock, bytes, usec)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)			DTRACE_PROBE1(vzvnc, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(vzvnc, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(vzvnc, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(vzvnc, name, a, b, c, d)
+#else
+#define PROBE1(name, a)			do { } while (0)
+#define PROBE2(name, a, b)		do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
+#endif /* __PROBES_H__ */
@@ -0,0 +1,356 @@
+/*
+ * psf.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "psf.h"
+#include "metrics.h"
+
+#define PSF2_MAGIC		0x864ab572
+#define PSF2_HAS_UNICODE_TABLE	0x01
+#define PSF2_SEPARATOR		0xff
+#define PSF2_STARTSEQ		0xfe
+
+struct psf2_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headersize;
+	uint32_t flags;
+	uint32_t length;	/* number of glyphs */
+	uint32_t charsize;	/* bytes per glyph */
+	uint32_t height, width;
+};
+
+struct map_entry {
+	uint32_t ucs;
+	uint32_t glyph;
+};
+
+struct cache_entry {
+	vcGlyph mask;
+	uint32_t ucs;
+	int prev, next;		/* LRU list, most recently used first */
+	int chain;		/* next entry in the same hash bucket */
+};
+
+struct vcPsf {
+	void *data;		/* the whole file, mapped */
+	size_t size;
+	const unsigned char *glyphs;
+	uint32_t count, charsize, width, height;
+	int cellWidth, cellHeight;
+
+	/* code point to glyph index, sorted by code point */
+	struct map_entry *map;
+	int nmap;
+
+	struct cache_entry cache[VC_GLYPH_CACHE];
+	int used, head, tail;
+	int buckets[VC_GLYPH_BUCKETS];
+};
+
+/* one UTF-8 sequence of the Unicode table, 0 if malformed */
+static uint32_t utf8_get(const unsigned char **p, const unsigned char *end)
+{
+	uint32_t ucs;
+	int more;
+
+	if (**p < 0x80)
+		return *(*p)++;
+	if (**p >= 0xc2 && **p < 0xe0) {
+		ucs = **p & 0x1f;
+		more = 1;
+	} else if (**p >= 0xe0 && **p < 0xf0) {
+		ucs = **p & 0x0f;
+		more = 2;
+	} else if (**p >= 0xf0 && **p < 0xf5) {
+		ucs = **p & 0x07;
+		more = 3;
+	} else {
+		(*p)++;
+		return 0;
+	}
+	for ((*p)++; more && *p < end && (**p & 0xc0) == 0x80; more--)
+		ucs = (ucs << 6) | (*(*p)++ & 0x3f);
+	return more ? 0 : ucs;
+}
+
+static int map_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const struct map_entry *)a)->ucs;
+	uint32_t y = ((const struct map_entry *)b)->ucs;
+
+	return x < y ? -1 : x > y;
+}
+
+static int map_add(vcPsfPtr f, int *size, uint32_t ucs, uint32_t glyph)
+{
+	struct map_entry *map;
+
+	if (f->nmap == *size) {
+		*size = *size ? 2 * *size : 512;
+		map = (struct map_entry *)realloc(f->map, *size * sizeof(*map));
+		if (map == NULL)
+			return -1;
+		f->map = map;
+	}
+	f->map[f->nmap].ucs = ucs;
+	f->map[f->nmap].glyph = glyph;
+	f->nmap++;
+	return 0;
+}
+
+/* Index the Unicode table: each glyph's code points, terminated by 0xff.
+ * Sequences of combining characters after 0xfe are not drawn. Without a
+ * table glyph N is code point N. */
+static int build_map(vcPsfPtr f, uint32_t flags)
+{
+	const unsigned char *p, *end = (const unsigned char *)f->data + f->size;
+	uint32_t i, ucs;
+	int size = 0;
+
+	if (!(flags & PSF2_HAS_UNICODE_TABLE)) {
+		for (i = 0; i < f->count; i++)
+			if (map_add(f, &size, i, i))
+				return -1;
+		return 0;
+	}
+	p = f->glyphs + f->count * f->charsize;
+	for (i = 0; i < f->count && p < end; i++) {
+		while (p < end && *p != PSF2_SEPARATOR) {
+			if (*p == PSF2_STARTSEQ) {
+				while (p < end && *p != PSF2_SEPARATOR)
+					p++;
+				break;
+			}
+			if ((ucs = utf8_get(&p, end)) && map_add(f, &size, ucs, i))
+				return -1;
+		}
+		p++;
+	}
+	qsort(f->map, f->nmap, sizeof(f->map[0]), map_cmp);
+	return 0;
+}
+
+vcPsfPtr vcPsfOpen(const char *path, int cellWidth, int cellHeight)
+{
+	struct psf2_header h;
+	struct stat st;
+	vcPsfPtr f;
+	int fd, err;
+
+	if (cellWidth > 16 || cellHeight > VC_GLYPH_ROWS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	f = (vcPsfPtr)calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+	f->data = MAP_FAILED;
+	f->cellWidth = cellWidth;
+	f->cellHeight = cellHeight;
+	f->head = f->tail = -1;
+	memset(f->buckets, -1, sizeof(f->buckets));
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		goto err;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(h)) {
+		f->size = st.st_size;
+		f->data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	} else {
+		errno = EINVAL;
+	}
+	err = errno;
+	close(fd);
+	errno = err;
+	if (f->data == MAP_FAILED)
+		goto err;
+
+	memcpy(&h, f->data, sizeof(h));
+	errno = EINVAL;
+	if (h.magic != PSF2_MAGIC || h.headersize < sizeof(h) ||
+	    h.width == 0 || h.height == 0 ||
+	    h.charsize < h.height * ((h.width + 7) / 8) ||
+	    h.headersize > f->size ||
+	    (f->size - h.headersize) / h.charsize < h.length)
+		goto err;
+	f->glyphs = (const unsigned char *)f->data + h.headersize;
+	f->count = h.length;
+	f->charsize = h.charsize;
+	f->width = h.width;
+	f->height = h.height;
+
+	if (build_map(f, h.flags)) {
+		errno = ENOMEM;
+		goto err;
+	}
+	return f;
+err:
+	err = errno;
+	vcPsfClose(f);
+	errno = err;
+	return NULL;
+}
+
+void vcPsfClose(vcPsfPtr f)
+{
+	if (f == NULL)
+		return;
+	if (f->data != MAP_FAILED)
+		munmap(f->data, f->size);
+	free(f->map);
+	free(f);
+}
+
+static int lookup(vcPsfPtr f, uint32_t ucs)
+{
+	int lo = 0, hi = f->nmap - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (f->map[mid].ucs == ucs)
+			return f->map[mid].glyph;
+		if (f->map[mid].ucs < ucs)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+int vcPsfHas(vcPsfPtr f, uint32_t ucs)
+{
+	return f && lookup(f, ucs) >= 0;
+}
+
+/* Centre the glyph in the cell, cropping it if it is the larger one. Line
+ * drawing characters must join their neighbours, so like VGA text mode
+ * does in its ninth column their edge pixels are repeated into the
+ * padding. */
+static void rasterize(vcPsfPtr f, int glyph, uint32_t ucs, vcGlyph *g)
+{
+	const unsigned char *bits = f->glyphs + glyph * f->charsize;
+	int stride = (f->width + 7) / 8;
+	int dx = (f->cellWidth - (int)f->width) / 2;
+	int dy = (f->cellHeight - (int)f->height) / 2;
+	int join = ucs >= 0x2500 && ucs <= 0x259f;
+	int x, y, sx, sy;
+
+	memset(g, 0, sizeof(*g));
+	for (y = 0; y < f->cellHeight; y++) {
+		sy = y - dy;
+		if (sy < 0 || sy >= (int)f->height) {
+			if (!join)
+				continue;
+			sy = sy < 0 ? 0 : f->height - 1;
+		}
+		for (x = 0; x < f->cellWidth; x++) {
+			sx = x - dx;
+			if (sx < 0 || sx >= (int)f->width) {
+				if (!join)
+					continue;
+				sx = sx < 0 ? 0 : f->width - 1;
+			}
+			if (bits[sy * stride + sx / 8] & (0x80 >> (sx % 8)))
+				g->row[y] |= 0x8000 >> x;
+		}
+	}
+}
+
+static void lru_unlink(vcPsfPtr f, int i)
+{
+	struct cache_entry *e = &f->cache[i];
+
+	if (e->prev >= 0)
+		f->cache[e->prev].next = e->next;
+	else
+		f->head = e->next;
+	if (e->next >= 0)
+		f->cache[e->next].prev = e->prev;
+	else
+		f->tail = e->prev;
+}
+
+static void lru_push(vcPsfPtr f, int i)
+{
+	f->cache[i].prev = -1;
+	f->cache[i].next = f->head;
+	if (f->head >= 0)
+		f->cache[f->head].prev = i;
+	else
+		f->tail = i;
+	f->head = i;
+}
+
+static void unhash(vcPsfPtr f, int i)
+{
+	int *p = &f->buckets[f->cache[i].ucs % VC_GLYPH_BUCKETS];
+
+	while (*p != i)
+		p = &f->cache[*p].chain;
+	*p = f->cache[i].chain;
+}
+
+/* the glyph fitted to the cell, NULL if the font has none; valid until
+ * the next call */
+const vcGlyph *vcPsfGlyph(vcPsfPtr f, uint32_t ucs)
+{
+	int *bucket, glyph, i;
+
+	if (f == NULL)
+		return NULL;
+	bucket = &f->buckets[ucs % VC_GLYPH_BUCKETS];
+	for (i = *bucket; i >= 0; i = f->cache[i].chain)
+		if (f->cache[i].ucs == ucs) {
+			if (i != f->head) {
+				lru_unlink(f, i);
+				lru_push(f, i);
+			}
+			return &f->cache[i].mask;
+		}
+
+	if ((glyph = lookup(f, ucs)) < 0)
+		return NULL;
+	METRIC_INC(METRIC_GLYPH_CACHE_MISSES);
+	if (f->used < VC_GLYPH_CACHE) {
+		i = f->used++;
+	} else {
+		i = f->tail;
+		lru_unlink(f, i);
+		unhash(f, i);
+	}
+	rasterize(f, glyph, ucs, &f->cache[i].mask);
+	f->cache[i].ucs = ucs;
+	f->cache[i].chain = *bucket;
+	*bucket = i;
+	lru_push(f, i);
+	return &f->cache[i].mask;
+}
@@ -0,0 +1,62 @@
+/*
+ * psf.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __PSF_H__
+#define __PSF_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "font.h"
+
+/*
+ * Glyphs for code points the built-in CP437 font doesn't have, from a
+ * PSF2 console font (as in /usr/share/consolefonts, uncompressed).
+ *
+ * The file is mapped, not read: opening it only indexes its Unicode
+ * table, and the pages of glyphs nobody prints are never touched. A
+ * glyph is fitted into the console cell the first time it is drawn and
+ * kept in a small LRU cache, so a font with thousands of glyphs costs
+ * no more memory than the few dozen a screen actually uses.
+ */
+
+/* cached glyphs; a full screen of distinct ones still fits */
+#define VC_GLYPH_CACHE		512
+#define VC_GLYPH_BUCKETS	1024
+
+typedef struct vcPsf vcPsf, *vcPsfPtr;
+
+vcPsfPtr vcPsfOpen(const char *path, int cellWidth, int cellHeight);
+void vcPsfClose(vcPsfPtr f);
+int vcPsfHas(vcPsfPtr f, uint32_t ucs);
+const vcGlyph *vcPsfGlyph(vcPsfPtr f, uint32_t ucs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PSF_H__ */
@@ -0,0 +1,262 @@
+/*
+ * recorder.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "vt100.h"
+#include "recorder.h"
+
+static int rec_fd = -1;
+static int idx_fd = -1;
+static uint64_t rec_offset;
+static long long rec_start;
+static long long last_keyframe;
+static long long rec_interval;
+static char *rec_attrs;		/* default attributes if the console has none */
+
+static long long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, struct iovec *iov, int n)
+{
+	ssize_t sz;
+
+	while (n > 0) {
+		sz = writev(fd, iov, n);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)sz >= iov->iov_len) {
+			sz -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + sz;
+			iov->iov_len -= sz;
+		}
+	}
+	return 0;
+}
+
+static void stop(const char *what)
+{
+	vzvnc_logger(VZ_VNC_ERR, "Session recording stopped, %s: %m", what);
+	recorder_close();
+}
+
+/* iov[0] is reserved for the record header */
+static int write_record(int type, long long now, struct iovec *iov, int n)
+{
+	struct rec_header hdr;
+	size_t len = 0;
+	int i;
+
+	for (i = 1; i < n; i++)
+		len += iov[i].iov_len;
+	hdr.type = type;
+	hdr.len = len;
+	hdr.time = now - rec_start;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	if (write_all(rec_fd, iov, n)) {
+		stop("write()");
+		return -1;
+	}
+	rec_offset += sizeof(hdr) + len;
+	return 0;
+}
+
+static void write_keyframe(vncConsolePtr console, unsigned char fore,
+		unsigned char back, unsigned char attr, long long now)
+{
+	struct rec_keyframe kf;
+	struct rec_index_entry entry;
+	struct iovec iov[4];
+	size_t cells = console->width * console->height;
+	char *attrs = rec_attrs;
+
+#ifdef USE_ATTRIBUTE_BUFFER
+	if (console->attributeBuffer)
+		attrs = console->attributeBuffer;
+#endif
+	memset(&kf, 0, sizeof(kf));
+	kf.x = console->x;
+	kf.y = console->y;
+	kf.sstart = console->sstart;
+	kf.sheight = console->sheight;
+	kf.fore = fore;
+	kf.back = back;
+	kf.attr = attr;
+	kf.cursor_active = console->cursorActive;
+	kf.wrap = console->wrapBottomToTop;
+
+	entry.time = now - rec_start;
+	entry.offset = rec_offset;
+
+	iov[1].iov_base = &kf;
+	iov[1].iov_len = sizeof(kf);
+	iov[2].iov_base = console->screenBuffer;
+	iov[2].iov_len = cells;
+	iov[3].iov_base = attrs;
+	iov[3].iov_len = cells;
+	if (write_record(REC_KEYFRAME, now, iov, 4))
+		return;
+
+	iov[0].iov_base = &entry;
+	iov[0].iov_len = sizeof(entry);
+	if (write_all(idx_fd, iov, 1)) {
+		stop("index write()");
+		return;
+	}
+	last_keyframe = now;
+}
+
+static int open_new(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+
+	if (fd < 0)
+		vzvnc_error(VZ_VNC_ERR_SYSTEM, "Can't create %s: %m", path);
+	return fd;
+}
+
+/*
+ * Start recording into path and path.idx, which must not exist: an audit
+ * trail is never overwritten. Called once the parser is initialized.
+ */
+int recorder_open(const char *path, int interval, vncConsolePtr console)
+{
+	char idx_path[PATH_MAX];
+	struct rec_file_header fh;
+	struct rec_index_header ih;
+	struct timeval tv;
+	struct iovec iov;
+	size_t cells = console->width * console->height;
+	unsigned char fore, back, attr;
+
+	if (snprintf(idx_path, sizeof(idx_path), "%s.idx", path) >= (int)sizeof(idx_path))
+		return vzvnc_error(VZ_VNC_ERR_PARAM, "Too long recording path %s", path);
+
+	rec_attrs = (char *)malloc(cells);
+	if (rec_attrs == NULL)
+		return vzvnc_error(VZ_VNC_ERR_SYSTEM, "Unable to allocate %zu bytes", cells);
+	memset(rec_attrs, 0x07, cells);
+
+	if ((rec_fd = open_new(path)) < 0 || (idx_fd = open_new(idx_path)) < 0) {
+		recorder_close();
+		return VZ_VNC_ERR_SYSTEM;
+	}
+
+	gettimeofday(&tv, NULL);
+	rec_start = now_usec();
+	rec_interval = (interval > 0 ? interval : REC_KEYFRAME_INTERVAL) * 1000000LL;
+
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, REC_MAGIC, sizeof(fh.magic));
+	fh.version = REC_VERSION;
+	fh.width = console->width;
+	fh.height = console->height;
+	fh.start_sec = tv.tv_sec;
+	fh.start_usec = tv.tv_usec;
+	fh.keyframe_interval = rec_interval / 1000000;
+	iov.iov_base = &fh;
+	iov.iov_len = sizeof(fh);
+	if (write_all(rec_fd, &iov, 1)) {
+		stop("write()");
+		return VZ_VNC_ERR_SYSTEM;
+	}
+	rec_offset = sizeof(fh);
+
+	memset(&ih, 0, sizeof(ih));
+	memcpy(ih.magic, REC_INDEX_MAGIC, sizeof(ih.magic));
+	ih.version = REC_VERSION;
+	ih.keyframe_interval = fh.keyframe_interval;
+	iov.iov_base = &ih;
+	iov.iov_len = sizeof(ih);
+	if (write_all(idx_fd, &iov, 1)) {
+		stop("index write()");
+		return VZ_VNC_ERR_SYSTEM;
+	}
+
+	/* time 0 is always seekable */
+	vt_ground_state(&fore, &back, &attr);
+	write_keyframe(console, fore, back, attr, rec_start);
+	if (rec_fd < 0)
+		return VZ_VNC_ERR_SYSTEM;
+
+	vzvnc_logger(VZ_VNC_INFO, "Recording session to %s", path);
+	return 0;
+}
+
+/* Record a chunk of tty output before it is fed to the parser. */
+void recorder_write(vncConsolePtr console, const char *buf, size_t len)
+{
+	struct iovec iov[2];
+	unsigned char fore, back, attr;
+	long long now;
+
+	if (rec_fd < 0 || len == 0)
+		return;
+
+	now = now_usec();
+	if (now - last_keyframe >= rec_interval && vt_ground_state(&fore, &back, &attr)) {
+		write_keyframe(console, fore, back, attr, now);
+		if (rec_fd < 0)
+			return;
+	}
+
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	write_record(REC_DATA, now, iov, 2);
+}
+
+void recorder_close(void)
+{
+	if (rec_fd >= 0)
+		close(rec_fd);
+	if (idx_fd >= 0)
+		close(idx_fd);
+	rec_fd = -1;
+	idx_fd = -1;
+	free(rec_attrs);
+	rec_attrs = NULL;
+}
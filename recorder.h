@@ -0,0 +1,114 @@
+/*
+ * recorder.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "console.h"
+
+/*
+ * Session recording: the raw tty stream as read by the main loop, each
+ * chunk stamped with the time since the start of the recording, plus a
+ * keyframe of the whole text screen every few seconds.
+ *
+ * FILE       rec_file_header, then records: rec_header + len bytes of
+ *            payload. REC_DATA payload is tty output, REC_KEYFRAME is
+ *            rec_keyframe + width*height characters + width*height
+ *            attributes. Per-cell underline and characters outside
+ *            the built-in font are not part of a keyframe: a replay
+ *            started there shows them plain, as the stand-in
+ *            character, until they are redrawn.
+ * FILE.idx   rec_index_header, then one rec_index_entry per keyframe.
+ *
+ * Both files are append-only and in host byte order. A player maps the
+ * index, finds the last keyframe before the wanted time (entries are
+ * sorted by time), loads the screen from it and replays only the data
+ * records which follow. Keyframes are taken between escape sequences
+ * only, so the parser may start from its ground state.
+ */
+
+#define REC_MAGIC		"VZVNCREC"
+#define REC_INDEX_MAGIC		"VZVNCIDX"
+#define REC_VERSION		1
+/* default seconds between two keyframes */
+#define REC_KEYFRAME_INTERVAL	30
+
+enum rec_type {
+	REC_DATA = 1,
+	REC_KEYFRAME = 2,
+};
+
+struct rec_file_header {
+	char magic[8];
+	uint32_t version;
+	uint16_t width, height;
+	uint64_t start_sec;	/* wall clock at time 0 */
+	uint32_t start_usec;
+	uint32_t keyframe_interval;
+};
+
+struct rec_header {
+	uint32_t type;
+	uint32_t len;		/* of the payload which follows */
+	uint64_t time;		/* usec since start */
+};
+
+struct rec_keyframe {
+	uint16_t x, y;
+	uint16_t sstart, sheight;
+	uint8_t fore, back;	/* current colours of the parser */
+	uint8_t cursor_active;
+	uint8_t wrap;
+	uint8_t attr;		/* and its SGR rendition, XA_* */
+	uint8_t reserved[3];
+};
+
+struct rec_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t keyframe_interval;
+};
+
+struct rec_index_entry {
+	uint64_t time;
+	uint64_t offset;	/* of the keyframe's rec_header in FILE */
+};
+
+int recorder_open(const char *path, int interval, vncConsolePtr console);
+void recorder_write(vncConsolePtr console, const char *buf, size_t len);
+void recorder_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RECORDER_H__ */
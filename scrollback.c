@@ -0,0 +1,226 @@
+/*
+ * scrollback.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scrollback.h"
+
+/*
+ * Row record: 2 bytes of record length, then the characters, then the
+ * attributes, each as a sequence of tokens covering exactly width cells:
+ *   0x00-0x7f  literal, (token+1) bytes follow
+ *   0x80-0xff  run, one byte follows, repeated (token-0x7f) times
+ * Attributes are almost always one or two runs, text is mostly literals
+ * with runs of blanks, so an 80 column row usually takes 20-60 bytes.
+ */
+
+struct block {
+	uint16_t used;		/* bytes of data[] in use */
+	uint16_t rows;		/* row records in data[] */
+	unsigned char data[SB_BLOCK_SIZE - 2 * sizeof(uint16_t)];
+};
+
+struct vcScrollback {
+	int width;
+	int nblocks;		/* budget, in blocks */
+	int first, count;	/* ring of blocks, oldest first */
+	int rows;
+	unsigned char *tmp;	/* compression buffer for one row */
+	struct block **blocks;
+};
+
+vcScrollbackPtr vcScrollbackNew(int width, size_t budget)
+{
+	vcScrollbackPtr sb;
+
+	if (budget < SB_BLOCK_SIZE)
+		return NULL;
+	sb = (vcScrollbackPtr)calloc(1, sizeof(*sb));
+	if (sb == NULL)
+		return NULL;
+	sb->width = width;
+	sb->nblocks = budget / SB_BLOCK_SIZE;
+	sb->blocks = (struct block **)calloc(sb->nblocks, sizeof(struct block *));
+	/* worst case: every cell a run, plus the length */
+	sb->tmp = (unsigned char *)malloc(4 * width + 2);
+	if (sb->blocks == NULL || sb->tmp == NULL) {
+		vcScrollbackFree(sb);
+		return NULL;
+	}
+	return sb;
+}
+
+void vcScrollbackFree(vcScrollbackPtr sb)
+{
+	int i;
+
+	if (sb == NULL)
+		return;
+	if (sb->blocks)
+		for (i = 0; i < sb->nblocks; i++)
+			free(sb->blocks[i]);
+	free(sb->blocks);
+	free(sb->tmp);
+	free(sb);
+}
+
+static unsigned char *rle_encode(unsigned char *out, const unsigned char *in, int n)
+{
+	int i = 0, run, lit;
+
+	while (i < n) {
+		for (run = 1; i + run < n && run < 128 && in[i + run] == in[i]; run++)
+			;
+		if (run >= 3) {
+			*out++ = 0x7f + run;
+			*out++ = in[i];
+			i += run;
+			continue;
+		}
+		/* literal up to the next run of 3 */
+		for (lit = 0; i + lit < n && lit < 128; lit++)
+			if (i + lit + 2 < n && in[i + lit] == in[i + lit + 1] &&
+			    in[i + lit] == in[i + lit + 2])
+				break;
+		*out++ = lit - 1;
+		memcpy(out, in + i, lit);
+		out += lit;
+		i += lit;
+	}
+	return out;
+}
+
+static const unsigned char *rle_decode(const unsigned char *in, unsigned char *out, int n)
+{
+	int i = 0, len;
+
+	while (i < n) {
+		if (*in & 0x80) {
+			len = *in++ - 0x7f;
+			if (len > n - i)
+				len = n - i;
+			memset(out + i, *in++, len);
+		} else {
+			len = *in++ + 1;
+			if (len > n - i)
+				len = n - i;
+			memcpy(out + i, in, len);
+			in += len;
+		}
+		i += len;
+	}
+	return in;
+}
+
+/* the block to append a record of len bytes to, recycling the oldest */
+static struct block *get_block(vcScrollbackPtr sb, int len)
+{
+	struct block *b;
+	int last;
+
+	if (sb->count) {
+		b = sb->blocks[(sb->first + sb->count - 1) % sb->nblocks];
+		if (b->used + len <= (int)sizeof(b->data))
+			return b;
+	}
+	if (sb->count == sb->nblocks) {
+		b = sb->blocks[sb->first];
+		sb->rows -= b->rows;
+		sb->first = (sb->first + 1) % sb->nblocks;
+		sb->count--;
+	}
+	last = (sb->first + sb->count) % sb->nblocks;
+	if (sb->blocks[last] == NULL) {
+		sb->blocks[last] = (struct block *)malloc(sizeof(struct block));
+		if (sb->blocks[last] == NULL)
+			return NULL;
+	}
+	b = sb->blocks[last];
+	b->used = 0;
+	b->rows = 0;
+	sb->count++;
+	return b;
+}
+
+void vcScrollbackPush(vcScrollbackPtr sb, const char *chars, const char *attrs)
+{
+	unsigned char *end;
+	struct block *b;
+	int len, i, run;
+
+	end = rle_encode(sb->tmp + 2, (const unsigned char *)chars, sb->width);
+	if (attrs)
+		end = rle_encode(end, (const unsigned char *)attrs, sb->width);
+	else
+		/* default colours, in runs no longer than rle_encode() makes */
+		for (i = 0; i < sb->width; i += run) {
+			run = sb->width - i < 128 ? sb->width - i : 128;
+			*end++ = 0x7f + run;
+			*end++ = 0x07;
+		}
+	len = end - sb->tmp;
+	sb->tmp[0] = len & 0xff;
+	sb->tmp[1] = len >> 8;
+
+	b = get_block(sb, len);
+	if (b == NULL)
+		return;
+	memcpy(b->data + b->used, sb->tmp, len);
+	b->used += len;
+	b->rows++;
+	sb->rows++;
+}
+
+int vcScrollbackRows(vcScrollbackPtr sb)
+{
+	return sb ? sb->rows : 0;
+}
+
+/* Fetch the n-th row counting back from the newest one (n = 1). */
+int vcScrollbackGet(vcScrollbackPtr sb, int n, char *chars, char *attrs)
+{
+	const unsigned char *p;
+	struct block *b = NULL;
+	int i, skip;
+
+	if (sb == NULL || n < 1 || n > sb->rows)
+		return -1;
+
+	for (i = sb->count - 1; i >= 0; i--) {
+		b = sb->blocks[(sb->first + i) % sb->nblocks];
+		if (n <= b->rows)
+			break;
+		n -= b->rows;
+	}
+	if (i < 0)
+		return -1;
+	p = b->data;
+	for (skip = b->rows - n; skip > 0; skip--)
+		p += p[0] | (p[1] << 8);
+	p = rle_decode(p + 2, (unsigned char *)chars, sb->width);
+	rle_decode(p, (unsigned char *)attrs, sb->width);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * scrollback.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __SCROLLBACK_H__
+#define __SCROLLBACK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * Rows scrolled off the top of the screen, characters and attributes.
+ *
+ * Every row is run-length compressed on the way in and appended to a ring
+ * of fixed-size blocks. Blocks are allocated as history grows; once the
+ * memory budget is used up the oldest block is recycled, so a console
+ * which never scrolls costs nothing and a busy one stays within budget.
+ */
+
+#define SB_BLOCK_SIZE	4096
+/* default budget per console, in bytes */
+#define SB_DEFAULT_SIZE	(64*1024)
+
+typedef struct vcScrollback vcScrollback, *vcScrollbackPtr;
+
+vcScrollbackPtr vcScrollbackNew(int width, size_t budget);
+void vcScrollbackFree(vcScrollbackPtr sb);
+void vcScrollbackPush(vcScrollbackPtr sb, const char *chars, const char *attrs);
+int vcScrollbackRows(vcScrollbackPtr sb);
+int vcScrollbackGet(vcScrollbackPtr sb, int n, char *chars, char *attrs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SCROLLBACK_H__ */
@@ -0,0 +1,136 @@
+/*
+ * shm.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "console.h"
+#include "shm.h"
+
+static struct vzvnc_shm_header *shm = NULL;
+static size_t shm_size;
+static char shm_name[NAME_MAX];
+
+/* cheap enough to be done after every chunk of tty output */
+static int changed(vncConsolePtr c)
+{
+	size_t cells = c->width * c->height;
+
+	if (shm->x != c->x || shm->y != c->y ||
+	    shm->sstart != c->sstart || shm->sheight != c->sheight ||
+	    shm->cursor_visible != vcCursorVisible(c))
+		return 1;
+	if (memcmp(vzvnc_shm_chars(shm), c->screenBuffer, cells))
+		return 1;
+#ifdef USE_ATTRIBUTE_BUFFER
+	if (c->attributeBuffer && memcmp(vzvnc_shm_attrs(shm), c->attributeBuffer, cells))
+		return 1;
+#endif
+	return 0;
+}
+
+void shm_export_update(vncConsolePtr c)
+{
+	size_t cells;
+
+	if (shm == NULL || !changed(c))
+		return;
+
+	cells = c->width * c->height;
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(vzvnc_shm_chars(shm), c->screenBuffer, cells);
+#ifdef USE_ATTRIBUTE_BUFFER
+	if (c->attributeBuffer)
+		memcpy(vzvnc_shm_attrs(shm), c->attributeBuffer, cells);
+#endif
+	shm->x = c->x;
+	shm->y = c->y;
+	shm->sstart = c->sstart;
+	shm->sheight = c->sheight;
+	shm->cursor_visible = vcCursorVisible(c);
+	shm->generation++;
+
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Create the segment VZVNC_SHM_PREFIX + name, replacing a stale one. */
+int shm_export_open(const char *name, vncConsolePtr c)
+{
+	size_t cells = c->width * c->height;
+	int fd;
+
+	snprintf(shm_name, sizeof(shm_name), VZVNC_SHM_PREFIX "%s", name);
+	shm_size = sizeof(struct vzvnc_shm_header) + 2 * cells;
+
+	shm_unlink(shm_name);
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return vzvnc_error(VZ_VNC_ERR_SYSTEM, "shm_open(%s): %m", shm_name);
+	if (ftruncate(fd, shm_size)) {
+		close(fd);
+		shm_unlink(shm_name);
+		return vzvnc_error(VZ_VNC_ERR_SYSTEM, "ftruncate(%s): %m", shm_name);
+	}
+	shm = (struct vzvnc_shm_header *)mmap(NULL, shm_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		shm_unlink(shm_name);
+		return vzvnc_error(VZ_VNC_ERR_SYSTEM, "mmap(%s): %m", shm_name);
+	}
+
+	/* zeroed by ftruncate(), readers wait until seq is even */
+	shm->seq = 1;
+	memcpy(shm->magic, VZVNC_SHM_MAGIC, sizeof(shm->magic));
+	shm->version = VZVNC_SHM_VERSION;
+	shm->size = shm_size;
+	shm->width = c->width;
+	shm->height = c->height;
+	memset(vzvnc_shm_chars(shm), ' ', cells);
+	memset(vzvnc_shm_attrs(shm), 0x07, cells);
+	__atomic_store_n(&shm->seq, 2, __ATOMIC_RELEASE);
+	shm_export_update(c);
+
+	vzvnc_logger(VZ_VNC_INFO, "Screen exported to /dev/shm%s", shm_name);
+	return 0;
+}
+
+void shm_export_close(void)
+{
+	if (shm == NULL)
+		return;
+	munmap(shm, shm_size);
+	shm_unlink(shm_name);
+	shm = NULL;
+}
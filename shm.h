@@ -0,0 +1,101 @@
+/*
+ * shm.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The text screen exported into a POSIX shared memory segment,
+ * /dev/shm/prl_vzvnc-CTID-ttyN, for local readers which only need to
+ * know what is on the console. The segment is a vzvnc_shm_header
+ * followed by width*height characters and width*height attributes
+ * (foreground | background << 4).
+ *
+ * The writer is the VT parser; readers never lock anything and take
+ * consistent snapshots with vzvnc_shm_read(). generation changes
+ * whenever the content or the cursor does.
+ */
+
+#define VZVNC_SHM_MAGIC		"VZVNCSHM"
+#define VZVNC_SHM_VERSION	1
+#define VZVNC_SHM_PREFIX	"/prl_vzvnc-"
+
+struct vzvnc_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* of the whole segment */
+	uint16_t width, height;
+	uint32_t seq;		/* seqlock, odd while being written */
+	uint64_t generation;
+	uint16_t x, y;		/* cursor */
+	uint16_t sstart, sheight;	/* scroll region */
+	uint8_t cursor_visible;
+	uint8_t reserved[7];
+};
+
+#define vzvnc_shm_chars(h)	((char *)(h) + sizeof(struct vzvnc_shm_header))
+#define vzvnc_shm_attrs(h)	(vzvnc_shm_chars(h) + (h)->width * (h)->height)
+
+/*
+ * Reader side: copy the header and the grid (chars and attrs, 2*width*
+ * height bytes) out of a mapped segment. Returns the number of attempts
+ * it took; the writer holds the lock for a couple of memcpy()s only.
+ */
+static inline int vzvnc_shm_read(const struct vzvnc_shm_header *shm,
+		struct vzvnc_shm_header *hdr, char *grid)
+{
+	uint32_t seq;
+	int tries = 0;
+
+	do {
+		tries++;
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(hdr, shm, sizeof(*hdr));
+		memcpy(grid, vzvnc_shm_chars(shm), 2 * shm->width * shm->height);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq);
+	return tries;
+}
+
+/* writer side, the server itself */
+struct vncConsole;
+int shm_export_open(const char *name, struct vncConsole *console);
+void shm_export_update(struct vncConsole *console);
+void shm_export_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHM_H__ */
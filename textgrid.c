@@ -0,0 +1,168 @@
+/*
+ * textgrid.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Text grid updates for clients which can draw the console themselves.
+ * An 80x24 screen of text is under 4KB even on a full repaint, and a
+ * typical update is a span or two and a cursor move.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <rfb/rfb.h>
+#include "client.h"
+#include "grid.h"
+#include "textgrid.h"
+
+static char *payload = NULL;
+static size_t payload_size = 0;
+
+static int textgrid_encodings[] = { VC_ENCODING_TEXTGRID, 0 };
+
+static rfbBool enable_textgrid(rfbClientPtr cl, void **data, int encoding)
+{
+	vncConsolePtr c = (vncConsolePtr)cl->screen->screenData;
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	(void)data;
+
+	/* once enabled, we are asked about every encoding nobody knows */
+	if (encoding != VC_ENCODING_TEXTGRID)
+		return FALSE;
+	/* updates are sent by libvncserver, which knows nothing of us */
+	if (vc == NULL || c->threaded)
+		return FALSE;
+	vc->textGridEncodings = rfbStatGetMessageCountRcvd(cl, rfbSetEncodings);
+	if (vc->textGrid)
+		return TRUE;
+	if ((vc->textGrid = vcGridNew(c)) == NULL) {
+		rfbLog("Unable to allocate text grid for %s\n", cl->host);
+		return FALSE;
+	}
+	rfbLog("Client %s gets text grid updates\n", cl->host);
+	return TRUE;
+}
+
+/*
+ * Called for every FramebufferUpdateRequest. libvncserver has no word for
+ * a pseudo-encoding which is no longer listed: a client which sent
+ * SetEncodings since it asked for text goes back to pixels, all of them.
+ */
+void vcTextGridCheck(rfbClientPtr cl)
+{
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	sraRegionPtr all;
+
+	if (vc == NULL || vc->textGrid == NULL ||
+	    rfbStatGetMessageCountRcvd(cl, rfbSetEncodings) == vc->textGridEncodings)
+		return;
+	vcGridFree(vc->textGrid);
+	vc->textGrid = NULL;
+	memset(vc->rowSent, 0, vc->height * sizeof(uint64_t));
+	all = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+	sraRgnOr(cl->modifiedRegion, all);
+	sraRgnDestroy(all);
+	rfbLog("Client %s is back to pixel updates\n", cl->host);
+}
+
+static rfbProtocolExtension textgrid_extension = {
+	.pseudoEncodings = textgrid_encodings,
+	.enablePseudoEncoding = enable_textgrid,
+};
+
+void vcTextGridRegister(void)
+{
+	rfbRegisterProtocolExtension(&textgrid_extension);
+}
+
+/*
+ * Answer a due client with the text changes since its last update.
+ * Returns FALSE for clients which didn't ask for text, those go through
+ * the usual pixel path.
+ */
+rfbBool vcTextGridUpdate(rfbClientPtr cl)
+{
+	vncConsolePtr c = (vncConsolePtr)cl->screen->screenData;
+	vncClientPtr vc = (vncClientPtr)cl->clientData;
+	rfbFramebufferUpdateMsg *fu;
+	rfbFramebufferUpdateRectHeader rect;
+	size_t hdr = sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader + 4;
+	size_t need = hdr + vcGridEncodedMax(c->width, c->height);
+	uint32_t n;
+	int len;
+
+	if (vc == NULL || vc->textGrid == NULL)
+		return FALSE;
+
+	if (need > payload_size) {
+		char *p = (char *)realloc(payload, need);
+		if (p == NULL) {
+			rfbLog("Unable to allocate %zu bytes for text grid update\n", need);
+			return TRUE;
+		}
+		payload = p;
+		payload_size = need;
+	}
+
+	/* pixels are of no interest to this client, whatever happened, and
+	 * neither is the cursor shape or position: the grid has its own */
+	sraRgnMakeEmpty(cl->modifiedRegion);
+	sraRgnMakeEmpty(cl->copyRegion);
+	cl->cursorWasChanged = FALSE;
+	cl->cursorWasMoved = FALSE;
+	cl->cursorX = cl->screen->cursorX;
+	cl->cursorY = cl->screen->cursorY;
+
+	len = vcGridEncode(vc->textGrid, c, (unsigned char *)payload + hdr,
+			payload_size - hdr);
+	if (len <= 0)
+		/* nothing changed in text: the request stays open */
+		return TRUE;
+
+	fu = (rfbFramebufferUpdateMsg *)payload;
+	fu->type = rfbFramebufferUpdate;
+	fu->pad = 0;
+	fu->nRects = Swap16IfLE(1);
+	rect.r.x = 0;
+	rect.r.y = 0;
+	rect.r.w = Swap16IfLE(cl->screen->width);
+	rect.r.h = Swap16IfLE(cl->screen->height);
+	rect.encoding = Swap32IfLE(VC_ENCODING_TEXTGRID);
+	memcpy(payload + sz_rfbFramebufferUpdateMsg, &rect, sz_rfbFramebufferUpdateRectHeader);
+	n = Swap32IfLE(len);
+	memcpy(payload + hdr - 4, &n, 4);
+
+	vcClientUpdateStart(cl);
+	if (rfbWriteExact(cl, payload, hdr + len) < 0) {
+		rfbLog("text grid update to %s failed\n", cl->host);
+		rfbCloseClient(cl);
+		return TRUE;
+	}
+	rfbStatRecordEncodingSent(cl, VC_ENCODING_TEXTGRID, hdr + len,
+			cl->screen->paddedWidthInBytes * cl->screen->height);
+	sraRgnMakeEmpty(cl->requestedRegion);
+	vcClientUpdateDone(cl);
+	return TRUE;
+}
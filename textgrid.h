@@ -0,0 +1,53 @@
+/*
+ * textgrid.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __TEXTGRID_H__
+#define __TEXTGRID_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "console.h"
+
+/*
+ * Private pseudo-encoding, "VZTG". A client which lists it in
+ * SetEncodings gets text instead of pixels: every FramebufferUpdate
+ * holds one rectangle covering the framebuffer with this encoding,
+ * followed by a u32 length and that many bytes of vcGridEncode()
+ * messages (see grid.h). The first update, and the answer to every
+ * non-incremental request, starts with a resync.
+ */
+#define VC_ENCODING_TEXTGRID	0x565A5447
+
+void vcTextGridRegister(void);
+rfbBool vcTextGridUpdate(rfbClientPtr cl);
+void vcTextGridCheck(rfbClientPtr cl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TEXTGRID_H__ */
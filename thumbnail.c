@@ -0,0 +1,232 @@
+/*
+ * thumbnail.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "util.h"
+#include "thumbnail.h"
+
+static int thumb_fd = -1;
+static char thumb_path[PATH_MAX];
+
+/* cached image and the row hashes it was rendered from */
+static unsigned char *png;
+static size_t png_len;
+static uint64_t *row_hash;
+static int rows;
+static unsigned long renders, requests;
+
+int thumb_open(const char *path)
+{
+	if ((thumb_fd = listen_unix(path)) < 0)
+		return VZ_VNC_ERR_SOCK;
+	snprintf(thumb_path, sizeof(thumb_path), "%s", path);
+	vzvnc_logger(VZ_VNC_INFO, "Thumbnails served on %s", path);
+	return 0;
+}
+
+void thumb_close(void)
+{
+	if (thumb_fd >= 0) {
+		close(thumb_fd);
+		unlink(thumb_path);
+		vzvnc_logger(VZ_VNC_DEBUG, "Thumbnails: %lu requests, %lu renders",
+				requests, renders);
+	}
+	thumb_fd = -1;
+	free(png);
+	png = NULL;
+	free(row_hash);
+	row_hash = NULL;
+}
+
+static uint64_t fnv(uint64_t h, const unsigned char *p, size_t len)
+{
+	while (len--)
+		h = (h ^ *p++) * 1099511628211ULL;
+	return h;
+}
+
+/*
+ * Text row hash if the row is plain text, otherwise (selection, history
+ * view) the hash of its pixels.
+ */
+static uint64_t hash_row(vncConsolePtr c, int row)
+{
+	rfbScreenInfoPtr s = c->screen;
+	uint64_t h = vcRowHash(c, row);
+
+	if (h)
+		return h;
+	h = fnv(14695981039346656037ULL,
+		(unsigned char *)s->frameBuffer + row * c->cHeight * s->paddedWidthInBytes,
+		c->cHeight * s->paddedWidthInBytes);
+	return h ? h : 1;
+}
+
+/* returns 1 if any row differs from the cached image */
+static int update_hashes(vncConsolePtr c)
+{
+	int i, changed = 0;
+	uint64_t h;
+
+	if (rows != c->height) {
+		free(row_hash);
+		row_hash = (uint64_t *)calloc(c->height, sizeof(uint64_t));
+		if (row_hash == NULL) {
+			rows = 0;
+			return 1;
+		}
+		rows = c->height;
+	}
+	for (i = 0; i < rows; i++) {
+		h = hash_row(c, i);
+		if (h != row_hash[i]) {
+			row_hash[i] = h;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+static void pixel_rgb(rfbScreenInfoPtr s, const unsigned char *p, unsigned *rgb)
+{
+	rfbPixelFormat *f = &s->serverFormat;
+	uint32_t v;
+
+	if (s->bitsPerPixel == 8) {
+		const unsigned char *map = s->colourMap.data.bytes + (*p & 0x0f) * 3;
+		rgb[0] += map[0];
+		rgb[1] += map[1];
+		rgb[2] += map[2];
+		return;
+	}
+	v = *(const uint32_t *)p;
+	rgb[0] += ((v >> f->redShift) & f->redMax) * 255 / f->redMax;
+	rgb[1] += ((v >> f->greenShift) & f->greenMax) * 255 / f->greenMax;
+	rgb[2] += ((v >> f->blueShift) & f->blueMax) * 255 / f->blueMax;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+/* length, type, data and crc of a chunk whose data is already in place */
+static unsigned char *put_chunk(unsigned char *p, const char *type, size_t len)
+{
+	put32(p, len);
+	memcpy(p + 4, type, 4);
+	put32(p + 8 + len, crc32(0, p + 4, len + 4));
+	return p + 12 + len;
+}
+
+/* box filter the framebuffer into RGB scanlines and wrap them into a PNG */
+static int render(vncConsolePtr c)
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	rfbScreenInfoPtr s = c->screen;
+	int w = s->width / THUMB_SCALE, h = s->height / THUMB_SCALE;
+	int bytes = s->bitsPerPixel / 8, x, y, i, j;
+	size_t raw_len = (size_t)(3 * w + 1) * h;
+	uLongf idat_len = compressBound(raw_len);
+	unsigned char *raw, *out, *p;
+	unsigned rgb[3];
+
+	raw = (unsigned char *)malloc(raw_len);
+	out = (unsigned char *)malloc(sizeof(signature) + 25 + 12 + idat_len + 12);
+	if (raw == NULL || out == NULL)
+		goto err;
+
+	p = raw;
+	for (y = 0; y < h; y++) {
+		*p++ = 0;	/* filter: none */
+		for (x = 0; x < w; x++) {
+			rgb[0] = rgb[1] = rgb[2] = 0;
+			for (j = 0; j < THUMB_SCALE; j++)
+				for (i = 0; i < THUMB_SCALE; i++)
+					pixel_rgb(s, (unsigned char *)s->frameBuffer +
+						(y * THUMB_SCALE + j) * s->paddedWidthInBytes +
+						(x * THUMB_SCALE + i) * bytes, rgb);
+			for (i = 0; i < 3; i++)
+				*p++ = rgb[i] / (THUMB_SCALE * THUMB_SCALE);
+		}
+	}
+
+	memcpy(out, signature, sizeof(signature));
+	p = out + sizeof(signature);
+	put32(p + 8, w);
+	put32(p + 12, h);
+	p[16] = 8;	/* bit depth */
+	p[17] = 2;	/* colour type: RGB */
+	p[18] = p[19] = p[20] = 0;
+	p = put_chunk(p, "IHDR", 13);
+	if (compress2(p + 8, &idat_len, raw, raw_len, Z_BEST_COMPRESSION) != Z_OK)
+		goto err;
+	p = put_chunk(p, "IDAT", idat_len);
+	p = put_chunk(p, "IEND", 0);
+
+	free(raw);
+	free(png);
+	png = out;
+	png_len = p - out;
+	renders++;
+	return 0;
+err:
+	vzvnc_logger(VZ_VNC_ERR, "Unable to render a thumbnail");
+	free(raw);
+	free(out);
+	return -1;
+}
+
+/* Called from the event loop with the console locked. */
+void thumb_poll(vncConsolePtr c)
+{
+	int fd;
+
+	if (thumb_fd < 0)
+		return;
+
+	while ((fd = accept(thumb_fd, NULL, NULL)) >= 0) {
+		requests++;
+		if ((update_hashes(c) || png == NULL) && render(c) && row_hash)
+			/* next request has to try again */
+			memset(row_hash, 0, rows * sizeof(uint64_t));
+		/* a few KB, fits into the socket buffer: never wait for the reader */
+		if (png && send(fd, png, png_len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)png_len)
+			vzvnc_logger(VZ_VNC_DEBUG, "Thumbnail not sent: %m");
+		close(fd);
+	}
+}
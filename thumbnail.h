@@ -0,0 +1,53 @@
+/*
+ * thumbnail.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __THUMBNAIL_H__
+#define __THUMBNAIL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "console.h"
+
+/*
+ * Thumbnail service: every connection to the Unix socket gets a PNG of
+ * the framebuffer scaled down by THUMB_SCALE and is closed. The image is
+ * cached and only re-rendered when one of the text rows changed, which
+ * is a per-row hash comparison; dashboards polling thousands of idle
+ * consoles cost no encoding at all.
+ */
+
+#define THUMB_SCALE	4
+
+int thumb_open(const char *path);
+void thumb_poll(vncConsolePtr console);
+void thumb_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __THUMBNAIL_H__ */
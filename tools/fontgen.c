@@ -0,0 +1,138 @@
+/*
+ * tools/fontgen.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+/*
+ * Build time font compiler: lays out the glyphs of vga.h into the fixed
+ * cell table described in font.h and writes it to stdout as a C header.
+ * Cell size and glyph placement are computed exactly as libvncserver's
+ * rfbWholeFontBBox() and rfbDrawChar() do it for vcGetConsole().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "font.h"
+
+/* vga.h only needs this much of <rfb/rfb.h> */
+typedef struct rfbFontData {
+	unsigned char *data;
+	int *metaData;
+} rfbFontData;
+
+#include "vga.h"
+
+/* rfbWholeFontBBox() */
+static void font_bbox(const int *m, int *x1, int *y1, int *x2, int *y2)
+{
+	int i;
+
+	*x1 = *y1 = INT_MAX;
+	*x2 = *y2 = 1 - INT_MAX;
+	for (i = 0; i < 256; i++) {
+		if (m[i * 5 + 1] - m[i * 5 + 3] > *x2)
+			*x2 = m[i * 5 + 1] - m[i * 5 + 3];
+		if (-m[i * 5 + 2] + m[i * 5 + 4] < *y1)
+			*y1 = -m[i * 5 + 2] + m[i * 5 + 4];
+		if (m[i * 5 + 3] < *x1)
+			*x1 = m[i * 5 + 3];
+		if (-m[i * 5 + 4] > *y2)
+			*y2 = -m[i * 5 + 4];
+	}
+	(*x2)++;
+	(*y2)++;
+}
+
+int main(void)
+{
+	const int *m = vgaFont.metaData;
+	int xhot, yhot, width, height, underline;
+	int ch, i, j, x, y, clipped = 0;
+	static vcGlyph g[256];
+
+	/* as vcGetConsole() */
+	font_bbox(m, &xhot, &height, &width, &yhot);
+	width -= xhot;
+	height = -height - yhot;
+	if (width > 16 || height > VC_GLYPH_ROWS || width <= 0 || height <= 0) {
+		fprintf(stderr, "fontgen: %dx%d cell doesn't fit into vcGlyph\n", width, height);
+		return 1;
+	}
+	underline = VC_UNDERLINE_ROW(height, yhot);
+
+	printf("/* Generated by tools/fontgen from vga.h, do not edit. */\n\n");
+	printf("#define VC_FONT_WIDTH\t%d\n", width);
+	printf("#define VC_FONT_HEIGHT\t%d\n", height);
+	printf("#define VC_FONT_HASH\t0x%016llxULL\n\n",
+		(unsigned long long)vcFontHash(vgaFont.data, m));
+
+	for (ch = 0; ch < 256; ch++) {
+		const unsigned char *data = vgaFont.data + m[ch * 5];
+		int w = m[ch * 5 + 1], h = m[ch * 5 + 2];
+		/* rfbDrawChar() at the position vcDrawCell() gives it */
+		int x0 = -xhot + (width - w) / 2 + m[ch * 5 + 3];
+		int y0 = height - yhot - 1 - m[ch * 5 + 4] - h + 1;
+		unsigned char d = 0;
+
+		for (i = 0; i < VC_GLYPH_ROWS; i++)
+			g[ch].row[i] = 0;
+		for (j = 0; j < h; j++)
+			for (i = 0; i < w; i++) {
+				if ((i & 7) == 0)
+					d = *data++;
+				x = x0 + i;
+				y = y0 + j;
+				if (d & 0x80) {
+					if (x < 0 || x >= width || y < 0 || y >= height)
+						clipped++;
+					else
+						g[ch].row[y] |= 0x8000 >> x;
+				}
+				d <<= 1;
+			}
+	}
+
+	/* VC_GLYPH_PLAIN, then VC_GLYPH_UNDERLINE */
+	printf("static const vcGlyph vcFontCells[VC_GLYPH_VARIANTS * 256] = {\n");
+	for (j = 0; j < VC_GLYPH_VARIANTS; j++)
+		for (ch = 0; ch < 256; ch++) {
+			printf("\t{{");
+			for (i = 0; i < VC_GLYPH_ROWS; i++)
+				printf("%s0x%04x", i ? "," : "",
+					j == VC_GLYPH_UNDERLINE && i == underline ?
+					(0xffff << (16 - width)) & 0xffff : g[ch].row[i]);
+			printf("}},\t/* %d */\n", ch);
+		}
+	printf("};\n");
+
+	/*
+	 * rfbWholeFontBBox() is a bit too small for the tallest glyphs, and
+	 * rfbDrawChar() drew those into the rows around the cell, where the
+	 * next redraw of a neighbour painted over them.
+	 */
+	if (clipped)
+		printf("\n/* %d pixels outside of their cells clipped */\n", clipped);
+	return 0;
+}
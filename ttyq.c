@@ -0,0 +1,145 @@
+/*
+ * ttyq.c
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "ttyq.h"
+#include "metrics.h"
+
+static int tty = -1;
+static enum ttyq_policy policy;
+static char queue[TTYQ_SIZE];
+static size_t head, tail;	/* queued data is queue[head..tail) */
+static int blocked;
+
+void ttyq_init(int fd, enum ttyq_policy p)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		vzvnc_logger(VZ_VNC_WARN, "Unable to make the tty non-blocking: %m");
+	tty = fd;
+	policy = p;
+	head = tail = 0;
+	blocked = 0;
+}
+
+void ttyq_close(void)
+{
+	if (tty < 0)
+		return;
+	tty = -1;
+	if (metrics_get(METRIC_TTY_BACKPRESSURE))
+		vzvnc_logger(VZ_VNC_INFO, "tty input: back-pressure %llu times, "
+				"%llu overflows, %llu bytes dropped",
+				metrics_get(METRIC_TTY_BACKPRESSURE),
+				metrics_get(METRIC_TTY_OVERFLOWS),
+				metrics_get(METRIC_TTY_DROPPED));
+}
+
+/* write out as much as the tty takes */
+void ttyq_flush(void)
+{
+	ssize_t sz;
+
+	if (tty < 0)
+		head = tail = 0;
+	while (head < tail) {
+		sz = write(tty, queue + head, tail - head);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!blocked)
+					METRIC_INC(METRIC_TTY_BACKPRESSURE);
+				blocked = 1;
+				return;
+			}
+			vzvnc_logger(VZ_VNC_ERR, "write(): %m");
+			head = tail = 0;
+			break;
+		}
+		head += sz;
+	}
+	head = tail = 0;
+	blocked = 0;
+}
+
+size_t ttyq_pending(void)
+{
+	return tail - head;
+}
+
+/* make room for len bytes, if the policy allows waiting for it */
+static int make_room(size_t len)
+{
+	struct pollfd pfd = { tty, POLLOUT, 0 };
+	int tries = TTYQ_WAIT_MAX * 1000 / TTYQ_RETRY;
+
+	for (;;) {
+		if (head && TTYQ_SIZE - tail < len) {
+			memmove(queue, queue + head, tail - head);
+			tail -= head;
+			head = 0;
+		}
+		if (TTYQ_SIZE - tail >= len)
+			return 0;
+		/* the tty may take a byte at a time, so poll in steps */
+		if (policy != TTYQ_WAIT || tries-- == 0)
+			return -1;
+		if (poll(&pfd, 1, TTYQ_RETRY / 1000) < 0 && errno != EINTR)
+			return -1;
+		ttyq_flush();
+	}
+}
+
+/*
+ * Queue len bytes for the tty. They are queued whole or dropped whole,
+ * so an escape sequence or a paste never gets cut in half.
+ */
+void ttyq_put(const void *buf, size_t len)
+{
+	unsigned long long overflows;
+
+	if (tty < 0 || len == 0)
+		return;
+	if (len > TTYQ_SIZE || make_room(len)) {
+		METRIC_INC(METRIC_TTY_OVERFLOWS);
+		METRIC_ADD(METRIC_TTY_DROPPED, len);
+		/* a frozen container must not flood the log either */
+		overflows = metrics_get(METRIC_TTY_OVERFLOWS);
+		if ((overflows & (overflows - 1)) == 0)
+			vzvnc_logger(VZ_VNC_WARN, "tty input queue full, %llu bytes "
+					"dropped so far", metrics_get(METRIC_TTY_DROPPED));
+		return;
+	}
+	memcpy(queue + tail, buf, len);
+	tail += len;
+}
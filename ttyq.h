@@ -0,0 +1,67 @@
+/*
+ * ttyq.h
+ *
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#ifndef __TTYQ_H__
+#define __TTYQ_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * Keyboard input to the tty is queued during an event loop pass and
+ * written out by one ttyq_flush() at its end, so a burst of key events
+ * costs one write() instead of one per key. A paste is queued as a
+ * whole, with keys typed meanwhile kept behind it.
+ *
+ * The tty is non-blocking: whatever it doesn't take stays queued and
+ * is retried every TTYQ_RETRY usec. A hung getty or a frozen container
+ * fills the queue, never the RFB event thread. Input which doesn't fit
+ * is dropped (TTYQ_DROP), or waited for up to TTYQ_WAIT_MAX msec first
+ * (TTYQ_WAIT), which stalls the viewers for at most that long.
+ */
+
+#define TTYQ_SIZE	(128*1024)
+#define TTYQ_RETRY	10000
+#define TTYQ_WAIT_MAX	1000
+
+enum ttyq_policy {
+	TTYQ_DROP,
+	TTYQ_WAIT,
+};
+
+void ttyq_init(int fd, enum ttyq_policy policy);
+void ttyq_close(void);
+void ttyq_put(const void *buf, size_t len);
+void ttyq_flush(void);
+size_t ttyq_pending(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TTYQ_H__ */
@@ -33,6 +33,9 @@
 #include <stdarg.h>
 #include <error.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <rfb/rfb.h>
 
 #include "util.h"
@@ -134,3 +137,33 @@ int vzvnc_error(int err_code, const char * format, ...)
 	return err_code;
 }
 
+
+/* Non-blocking listening socket at path, only accessible by us. */
+int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		vzvnc_error(VZ_VNC_ERR_PARAM, "Too long socket path %s", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		vzvnc_error(VZ_VNC_ERR_SOCK, "socket(): %m");
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0600) || listen(fd, 16)) {
+		vzvnc_error(VZ_VNC_ERR_SOCK, "Can't listen on %s: %m", path);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
@@ -45,6 +45,7 @@ extern "C" {
 void init_logger(const char * log_file, int log_level, int is_verbose);
 void vzvnc_logger(int log_level, const char * format, ...);
 int vzvnc_error(int err_code, const char * format, ...);
+int listen_unix(const char *path);
 
 #ifdef __cplusplus
 }
@@ -30,9 +30,14 @@
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include <rfb/keysym.h>
+#include "util.h"
 #include "vt100.h"
+#include "metrics.h"
+#include "probes.h"
 
 /*
  * The global variable esc_s holds the escape sequence status:
@@ -52,6 +57,8 @@ static int esc_s = 0;
 
 static unsigned char vt_fg;		/* Standard foreground color. */
 static unsigned char vt_bg;		/* Standard background color. */
+static unsigned char vt_attr;		/* XA_* */
+static unsigned char vt_cfg, vt_cbg;	/* the two as vt_attr shows them */
 
 static unsigned short escparms[ESCPARMS_SIZE];		/* Cumulated escape sequence. */
 static int ptr;                 /* Index into escparms array. */
@@ -59,32 +66,200 @@ static int ptr;                 /* Index into escparms array. */
 static short newy1 = 0;		/* Current size of scrolling region. */
 static short newy2 = 23;
 
+/* Output is UTF-8 unless told otherwise; it is decoded in front of the
+ * parser, in the ground state only. */
+#define VT_REPLACEMENT	0xfffd
+
+static rfbBool utf8 = TRUE;
+static uint32_t utf8_ucs;	/* code point decoded so far */
+static uint32_t utf8_min;	/* smallest one its length may encode */
+static int utf8_more;		/* continuation bytes still expected */
+
 static void state1(vncConsole *console, unsigned char c);
 static void state2(vncConsole *console, unsigned char c);
 static void state3(vncConsole *console, unsigned char c);
 static void state6(unsigned char c);
 
+#define VT_STATES	8
+#define VT_PROFILE_TOP	40
+
+struct vt_prof {
+	unsigned long count;
+	long long nsec;
+};
+/* [esc_s the final byte came in][final byte], NULL unless profiling */
+static struct vt_prof *prof;
+static long long prof_pending;	/* nsec spent in the current sequence */
+
+static long long prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int vt_profile_start(void)
+{
+	prof = (struct vt_prof *)calloc(VT_STATES * 256, sizeof(struct vt_prof));
+	if (prof == NULL)
+		return vzvnc_error(VZ_VNC_ERR_SYSTEM, "Unable to allocate escape profile");
+	return 0;
+}
+
+static void prof_name(char *buf, size_t size, int state, int c)
+{
+	static const char *prefix[VT_STATES] = {
+		"", "ESC ", "CSI ", "CSI ? ", "ESC ( ", "ESC ) ", "ESC # ", "DCS "
+	};
+
+	if (isgraph(c))
+		snprintf(buf, size, "%s%c", prefix[state], c);
+	else
+		snprintf(buf, size, "%s0x%02x", prefix[state], c);
+}
+
+static int prof_cmp(const void *a, const void *b)
+{
+	long long d = prof[*(const int *)b].nsec - prof[*(const int *)a].nsec;
+
+	return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
+
+/* log the most expensive sequences first, plain text summed up */
+void vt_profile_dump(void)
+{
+	int order[VT_STATES * 256], n = 0, i;
+	unsigned long text_count = 0;
+	long long text_nsec = 0;
+	char name[16];
+
+	if (prof == NULL)
+		return;
+	for (i = 0; i < 256; i++) {
+		text_count += prof[i].count;
+		text_nsec += prof[i].nsec;
+	}
+	for (i = 256; i < VT_STATES * 256; i++)
+		if (prof[i].count)
+			order[n++] = i;
+	qsort(order, n, sizeof(order[0]), prof_cmp);
+
+	vzvnc_logger(VZ_VNC_INFO, "Escape profile: %-10s %12s %12s %8s",
+			"sequence", "count", "total us", "avg ns");
+	vzvnc_logger(VZ_VNC_INFO, "Escape profile: %-10s %12lu %12lld %8lld",
+			"(text)", text_count, text_nsec / 1000,
+			text_count ? text_nsec / (long long)text_count : 0);
+	for (i = 0; i < n && i < VT_PROFILE_TOP; i++) {
+		struct vt_prof *p = &prof[order[i]];
+
+		prof_name(name, sizeof(name), order[i] / 256, order[i] % 256);
+		vzvnc_logger(VZ_VNC_INFO, "Escape profile: %-10s %12lu %12lld %8lld",
+				name, p->count, p->nsec / 1000,
+				p->nsec / (long long)p->count);
+	}
+}
+
+
+void vt_set_utf8(rfbBool on)
+{
+	utf8 = on;
+	utf8_more = 0;
+}
+
+/* Feed one byte >= 0x80: the code point once it is complete, 0 while
+ * more bytes are expected, VT_REPLACEMENT for anything malformed. */
+static uint32_t utf8_decode(unsigned char c)
+{
+	if (utf8_more) {
+		utf8_ucs = (utf8_ucs << 6) | (c & 0x3f);
+		if (--utf8_more)
+			return 0;
+		if (utf8_ucs < utf8_min || utf8_ucs > 0x10ffff ||
+		    (utf8_ucs >= 0xd800 && utf8_ucs <= 0xdfff))
+			return VT_REPLACEMENT;
+		return utf8_ucs;
+	}
+	if (c >= 0xc2 && c < 0xe0) {
+		utf8_ucs = c & 0x1f;
+		utf8_min = 0x80;
+		utf8_more = 1;
+	} else if (c >= 0xe0 && c < 0xf0) {
+		utf8_ucs = c & 0x0f;
+		utf8_min = 0x800;
+		utf8_more = 2;
+	} else if (c >= 0xf0 && c < 0xf5) {
+		utf8_ucs = c & 0x07;
+		utf8_min = 0x10000;
+		utf8_more = 3;
+	} else {
+		/* continuation byte out of place, or never valid */
+		return VT_REPLACEMENT;
+	}
+	return 0;
+}
+
+/*
+ * Colours and rendition of the characters from now on. Bold is the bright
+ * foreground and blink the bright background, as in VGA text mode with
+ * blinking off; reverse swaps the pair. Underline is the only one that
+ * needs glyphs of its own.
+ */
+static void set_rendition(vncConsole *console)
+{
+	unsigned char t;
+
+	vt_cfg = vt_fg | (vt_attr & XA_BOLD ? 8 : 0);
+	vt_cbg = vt_bg | (vt_attr & XA_BLINK ? 8 : 0);
+	if (vt_attr & XA_REVERSE) {
+		t = vt_cfg;
+		vt_cfg = vt_cbg;
+		vt_cbg = t;
+	}
+	console->rendition = vt_attr & XA_UNDERLINE ? VC_CELL_UNDERLINE : 0;
+}
 
 void vt_init(vncConsole *console)
 {
 	memset(escparms, 0, sizeof(escparms));
 	memset(console->screenBuffer, ' ', console->width * console->height);
+	memset(console->cellBuffer, 0,
+		console->width * console->height * sizeof(uint32_t));
 	console->x=0;
 	console->y=0;
 	console->cursorActive=TRUE;
 	vt_fg = WHITE;
 	vt_bg = BLACK;
+	vt_attr = XA_NORMAL;
+	set_rendition(console);
+}
+
+/* current colours and rendition, FALSE if in the middle of an escape
+ * sequence or of a UTF-8 character */
+rfbBool vt_ground_state(unsigned char *fg, unsigned char *bg,
+		unsigned char *attr)
+{
+	*fg = vt_fg;
+	*bg = vt_bg;
+	*attr = vt_attr;
+	return esc_s == 0 && utf8_more == 0;
 }
 
 void vt_out(vncConsole *console, unsigned char c)
 {
 	static unsigned char last_ch;
-	int go_on = 0;
+	int go_on = 0, state;
+	long long t = 0;
+	uint32_t ucs = 0;
 
 	if (c == 0)
 		return;
 	last_ch = c;(void)last_ch;
 
+	/* new output brings the view back from history */
+	if (console->viewOffset)
+		vcScrollHistory(console, -console->viewOffset);
+
 	if (esc_s) {
 		fprintf(stdout, "_%c ", c);
 	} else {
@@ -96,13 +271,21 @@ void vt_out(vncConsole *console, unsigned char c)
 	}
 	fflush(stdout);
 
+	if (utf8_more && (c & 0xc0) != 0x80) {
+		/* sequence cut short, c is a character of its own */
+		utf8_more = 0;
+		vcPutUnicodeColour(console, VT_REPLACEMENT, vt_cfg, vt_cbg);
+	}
+	if (utf8 && esc_s == 0 && c >= 0x80 && !(ucs = utf8_decode(c)))
+		return;
+
 	/* Process <31 chars first, even in an escape sequence. */
 	switch (c) {
 	case '\r': /* Carriage return */
-		vcPutCharColour(console, c, vt_fg, vt_bg);
+		vcPutCharColour(console, c, vt_cfg, vt_cbg);
 		break;
 	case '\t': /* Non - destructive TAB */
-		vcPutCharColour(console, c, vt_fg, vt_bg);
+		vcPutCharColour(console, c, vt_cfg, vt_cbg);
 		break;
 	case 013: /* Old Minix: CTRL-K = up */
 		fprintf(stdout, "Old Minix: CTRL-K = up\n");
@@ -120,20 +303,22 @@ void vt_out(vncConsole *console, unsigned char c)
 	case ESC: /* Begin escape sequence */
 		esc_s = 1;
 		break;
-	case 128+ESC: /* Begin ESC [ sequence. */
+	case 128+ESC: /* Begin ESC [ sequence, UTF-8 has no 8-bit controls. */
+		if (utf8) {
+			go_on = 1;
+			break;
+		}
 		esc_s = 2;
 		break;
 	case '\b': /* Backspace */
 
-		vcHideCursor(console);
 		console->x--;
-//		vcPutCharColour(console, ' ', vt_fg, vt_bg);
+//		vcPutCharColour(console, ' ', vt_cfg, vt_cbg);
 //		console->x--;
-		vcDrawCursor(console);
 		break;
 
 	case '\n':
-		vcPutCharColour(console, c, vt_fg, vt_bg);
+		vcPutCharColour(console, c, vt_cfg, vt_cbg);
 		break;
 	case 7: /* Bell */
 		rfbSendBell( console->screen );
@@ -146,9 +331,15 @@ void vt_out(vncConsole *console, unsigned char c)
 		return;
 
 	/* Now see which state we are in. */
+	state = esc_s;
+	if (prof)
+		t = prof_now();
 	switch (esc_s) {
 	case 0: /* Normal character */
-		vcPutCharColour(console, c, vt_fg, vt_bg);
+		if (ucs)
+			vcPutUnicodeColour(console, ucs, vt_cfg, vt_cbg);
+		else
+			vcPutCharColour(console, c, vt_cfg, vt_cbg);
 		break;
 	case 1: /* ESC seen */
 		state1(console, c);
@@ -172,6 +363,18 @@ void vt_out(vncConsole *console, unsigned char c)
 		fprintf(stdout, "Device dependant control strings\n");
 		break;
 	}
+	if (state && !esc_s) {
+		METRIC_INC(METRIC_ESCAPES);
+		PROBE2(escape, state, c);
+	}
+	if (prof) {
+		prof_pending += prof_now() - t;
+		if (!esc_s) {
+			prof[state * 256 + c].count++;
+			prof[state * 256 + c].nsec += prof_pending;
+			prof_pending = 0;
+		}
+	}
 }
 
 /*
@@ -229,7 +432,6 @@ static void state1(vncConsole *console, unsigned char c)
 		break;
 	case 'c': /* Reset to initial state */
 		fprintf(stdout, "Reset to initial state\n");
-		vcHideCursor(console);
 		vcReset(console);
 		break;
 	case 'H': /* Set tab in current position */
@@ -268,7 +470,6 @@ static void ansi_mode(int on_off)
 static void state2(vncConsole *console, unsigned char c)
 {
 	unsigned short x, y, f;
-	unsigned char attr;
 
 	/* See if a number follows */
 	if (c >= '0' && c <= '9') {
@@ -317,7 +518,6 @@ static void state2(vncConsole *console, unsigned char c)
 			if (y <= newy1 - 1)
 				y = newy1;
 		}
-		vcHideCursor(console);
 		console->x = x;
 		console->y = y;
 		fprintf(stdout, "x=%d y=%d\n", console->x, console->y);
@@ -334,7 +534,6 @@ static void state2(vncConsole *console, unsigned char c)
 			x = console->width;
 		if (y >= console->height)
 			y = console->height;
-		vcHideCursor(console);
 		console->x = x - 1;
 		console->y = y - 1;
 		break;
@@ -343,30 +542,31 @@ static void state2(vncConsole *console, unsigned char c)
 		break;
 	case 'K': /* Line erasing */
 		fprintf(stdout, "Line erasing (%d)\n", escparms[0]);
+		/* blanks take the colours, but are never underlined */
+		console->rendition = 0;
 		switch (escparms[0]) {
 		case 0:
 			/* Clear to end of line ??? or Backspace? */
 			f = console->x;
 			for( ; console->x < console->width; )
-				vcPutCharColour(console, ' ', vt_fg, vt_bg);
-			vcHideCursor(console);
+				vcPutCharColour(console, ' ', vt_cfg, vt_cbg);
 			console->x = f;
 			break;
 		case 1:
 			/* Clear to begin of line. */
 			f = console->x;
 			for( console->x = 0; console->x < f; )
-				vcPutCharColour(console, ' ', vt_fg, vt_bg);
+				vcPutCharColour(console, ' ', vt_cfg, vt_cbg);
 			break;
 		case 2:
 			/* Clear entire line. */
 			f = console->x;
 			for( console->x = 0; console->x < console->width;  )
-				vcPutCharColour(console, ' ', vt_fg, vt_bg);
-			vcHideCursor(console);
+				vcPutCharColour(console, ' ', vt_cfg, vt_cbg);
 			console->x = f;
 			break;
 		}
+		set_rendition(console);
 		break;
 	case 'J': /* Screen erasing */
 	{
@@ -382,13 +582,7 @@ static void state2(vncConsole *console, unsigned char c)
 			//break;
 		case 2:
 			/* Clear a window. */
-			memset(console->screen->frameBuffer, BLACK,
-				console->screen->width * console->screen->height);
-			memset(console->screenBuffer, ' ', console->width * console->height);
-#ifdef USE_ATTRIBUTE_BUFFER
-			memset(console->attributeBuffer, 0x07, console->width * console->height);
-#endif
-			rfbMarkRectAsModified(console->screen, 0, 0, console->screen->width, console->screen->height);
+			vcClearScreen(console, BLACK);
 			//mc_winclr(vt_win);
 			break;
 		}
@@ -421,42 +615,46 @@ static void state2(vncConsole *console, unsigned char c)
 	case 'm': /* Set attributes */
 	{
 		fprintf(stdout, "Set attributes\n");
-//		attr = mc_wgetattr((vt_win));
 		for (f = 0; f <= ptr; f++) {
 
 			if (escparms[f] >= 30 && escparms[f] <= 37)
-				vt_fg = (vt_fg & 15) + (escparms[f] - 30);
+				vt_fg = escparms[f] - 30;
 			if (escparms[f] >= 40 && escparms[f] <= 47)
-				vt_bg = (vt_bg & 240) + (escparms[f] - 40);
+				vt_bg = escparms[f] - 40;
+			/* bright colours (aixterm) */
+			if (escparms[f] >= 90 && escparms[f] <= 97)
+				vt_fg = escparms[f] - 90 + 8;
+			if (escparms[f] >= 100 && escparms[f] <= 107)
+				vt_bg = escparms[f] - 100 + 8;
 			switch (escparms[f]) {
 			case 0:
-				attr = XA_NORMAL;
+				vt_attr = XA_NORMAL;
 				vt_fg = WHITE;
 				vt_bg = BLACK;
 				break;
 			case 1:
-				attr |= XA_BOLD;
+				vt_attr |= XA_BOLD;
 				break;
 			case 4:
-				attr |= XA_UNDERLINE;
+				vt_attr |= XA_UNDERLINE;
 				break;
 			case 5:
-				attr |= XA_BLINK;
+				vt_attr |= XA_BLINK;
 				break;
 			case 7:
-				attr |= XA_REVERSE;
+				vt_attr |= XA_REVERSE;
 				break;
 			case 22: /* Bold off */
-				attr &= ~XA_BOLD;
+				vt_attr &= ~XA_BOLD;
 				break;
 			case 24: /* Not underlined */
-				attr &=~XA_UNDERLINE;
+				vt_attr &= ~XA_UNDERLINE;
 				break;
 			case 25: /* Not blinking */
-				attr &= ~XA_BLINK;
+				vt_attr &= ~XA_BLINK;
 				break;
 			case 27: /* Not reverse */
-				attr &= ~XA_REVERSE;
+				vt_attr &= ~XA_REVERSE;
 				break;
 			case 39: /* Default fg color */
 				vt_fg = 0x07;
@@ -466,7 +664,7 @@ static void state2(vncConsole *console, unsigned char c)
 				break;
 			}
 		}
-//		mc_wsetattr(vt_win, attr);
+		set_rendition(console);
 		break;
 	}
 	case 'L': /* Insert lines */
@@ -535,12 +733,11 @@ static void dec_mode(vncConsole *console, int on_off)
 			break;
 		case 25: /* Cursor on/off */
 			fprintf(stdout, "Cursor");
-			if( on_off )
-				vcDrawCursor( console );
-			else
-				vcHideCursor( console );
 			console->dontDrawCursor = !on_off;
 			break;
+		case 2004: /* Bracketed paste */
+			console->bracketedPaste = on_off;
+			break;
 		default: /* Mostly set up functions */
 			/* IGNORED */
 			fprintf(stdout, "%d parameter IGNORED", escparms[i]);
@@ -35,6 +35,18 @@ extern "C" {
 
 void vt_init(vncConsole *console);
 void vt_out(vncConsole *console, unsigned char c);
+rfbBool vt_ground_state(unsigned char *fg, unsigned char *bg,
+		unsigned char *attr);
+/* decode output as UTF-8 (the default) or take it as CP437 bytes */
+void vt_set_utf8(rfbBool on);
+
+/*
+ * Escape sequence profile: how many times each final byte was executed
+ * in each parser state and the time spent parsing and executing it,
+ * parameters included. Plain text is one line of its own.
+ */
+int vt_profile_start(void);
+void vt_profile_dump(void);
 
 #ifdef __cplusplus
 }